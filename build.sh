@@ -5,8 +5,8 @@ CFLAGS="\
 -Wno-missing-field-initializers \
 -Wno-unused-parameter \
 -Wfatal-errors -std=c99 \
--lavutil -lavformat -lavcodec -lavutil \
--lswscale -lswresample -lz -lm -lpthread -lasound \
+-lavutil -lavformat -lavcodec -lavfilter -lavutil \
+-lswscale -lswresample -lz -lm -lpthread -lrt -lasound \
 -D_POSIX_C_SOURCE=200809L $CFLAGS"
 
 OS="$(uname)"
@@ -1,6 +1,10 @@
 #define FFS_AUDIO	0x1000
 #define FFS_VIDEO	0x2000
 #define FFS_SUBTS	0x4000
+#define FFS_KEYS	0x8000	/* decode only key frames */
+#define FFS_LIVE	0x10000	/* live source; probe little and do not buffer */
+#define FFS_QLEN	64	/* queued packets of a peer stream */
+#define FFS_TIMEOUT	5000	/* live sources: fail reads blocked this long (ms) */
 #define FFS_STRIDX	0x0fff
 #define FFS_SAMPLEFMT		AV_SAMPLE_FMT_S16
 //#define FFS_CHLAYOUT		AV_CHANNEL_LAYOUT_STEREO
@@ -12,17 +16,68 @@ struct ffs {
 	AVStream *st;
 	AVPacket pkt;
 	int si;			/* stream index */
+	int live;		/* FFS_LIVE: reads time out */
+	long rdue;		/* when the pending read times out; see ffs_intr() */
 	long ts;		/* frame timestamp (ms) */
 	long pts;		/* last decoded packet pts in milliseconds */
 	long dur;		/* last decoded packet duration */
+	long fts;		/* last decoded frame timestamp in milliseconds */
+	float speed;		/* playback speed */
 
 	/* decoding video frames */
 	struct SwsContext *swsc;
 	struct SwrContext *swrc;
 	AVFrame *dst;
 	AVFrame *tmp;
+	uint8_t *dbuf;		/* dst buffer; reused by ffs_vconf() */
+	int dlen;		/* dbuf size */
+
+	/* changing audio tempo */
+	AVFilterGraph *fg;
+	AVFilterContext *fsrc;
+	AVFilterContext *fsink;
+	AVFrame *flt;
+
+	/* streams sharing a demuxer; see ffs_peer() */
+	struct ffs *peer;	/* receives the packets of its stream */
+	int shared;		/* fc belongs to another ffs */
+	AVPacket *q[FFS_QLEN];	/* packets demuxed by the owner of fc */
+	int qn;
 };
 
+static long ts_fake = -1;	/* virtual time in milliseconds if not negative */
+
+static long ts_ms(void)
+{
+	struct timespec ts;
+	if (ts_fake >= 0)
+		return ts_fake;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int ffs_quit;		/* interrupt all blocking reads */
+
+/* abort blocking reads; may be called from signal handlers */
+void ffs_abort(void)
+{
+	ffs_quit = 1;
+}
+
+/* the interrupt callback of libavformat */
+static int ffs_intr(void *dat)
+{
+	struct ffs *ffs = dat;
+	return ffs_quit || (ffs->rdue && ts_ms() > ffs->rdue);
+}
+
+/* start the timeout of a read of a live source */
+static void ffs_rdue(struct ffs *ffs)
+{
+	if (ffs->live)
+		ffs->rdue = ts_ms() + FFS_TIMEOUT;
+}
+
 static int ffs_stype(int flags)
 {
 	if (flags & FFS_VIDEO)
@@ -42,47 +97,140 @@ void ffs_free(struct ffs *ffs)
 		sws_freeContext(ffs->swsc);
 	if (ffs->dst)
 		av_free(ffs->dst);
+	av_free(ffs->dbuf);
 	if (ffs->tmp)
 		av_free(ffs->tmp);
+	if (ffs->flt)
+		av_frame_free(&ffs->flt);
+	if (ffs->fg)
+		avfilter_graph_free(&ffs->fg);
 	if (ffs->cc)
 		avcodec_free_context(&ffs->cc);
-	if (ffs->fc)
+	while (ffs->qn)
+		av_packet_free(&ffs->q[--ffs->qn]);
+	if (ffs->fc && !ffs->shared)
 		avformat_close_input(&ffs->fc);
 	free(ffs);
 }
 
-struct ffs *ffs_alloc(char *path, int flags)
+/* find the stream and open its decoder */
+static int ffs_open(struct ffs *ffs, int flags)
 {
-	struct ffs *ffs;
 	int idx = (flags & FFS_STRIDX) - 1;
-	ffs = malloc(sizeof(*ffs));
-	memset(ffs, 0, sizeof(*ffs));
-	ffs->si = -1;
-	if (avformat_open_input(&ffs->fc, path, NULL, NULL))
-		goto failed;
-	if (avformat_find_stream_info(ffs->fc, NULL) < 0)
-		goto failed;
+	const AVCodec *dec;
 	ffs->si = av_find_best_stream(ffs->fc, ffs_stype(flags), idx, -1, NULL, 0);
 	if (ffs->si < 0)
-		goto failed;
+		return 1;
 	ffs->st = ffs->fc->streams[ffs->si];
-	const AVCodec *dec = avcodec_find_decoder(ffs->st->codecpar->codec_id);
+	dec = avcodec_find_decoder(ffs->st->codecpar->codec_id);
 	ffs->cc = avcodec_alloc_context3(dec);
 	avcodec_parameters_to_context(ffs->cc, ffs->st->codecpar);
+	if (flags & FFS_LIVE) {
+		/* frame threads delay each frame by the number of threads */
+		ffs->cc->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		ffs->cc->thread_type = FF_THREAD_SLICE;
+	}
 	if (avcodec_open2(ffs->cc, dec, NULL))
-		goto failed;
+		return 1;
+	if (flags & FFS_KEYS)
+		ffs->cc->skip_frame = AVDISCARD_NONKEY;
 	ffs->tmp = av_frame_alloc();
 	ffs->dst = av_frame_alloc();
+	return 0;
+}
+
+struct ffs *ffs_alloc(char *path, int flags)
+{
+	struct ffs *ffs;
+	AVDictionary *opts = NULL;
+	ffs = malloc(sizeof(*ffs));
+	memset(ffs, 0, sizeof(*ffs));
+	ffs->si = -1;
+	ffs->speed = 1;
+	if (!(ffs->fc = avformat_alloc_context()))
+		goto failed;
+	ffs->fc->interrupt_callback.callback = ffs_intr;
+	ffs->fc->interrupt_callback.opaque = ffs;
+	if (flags & FFS_LIVE) {
+		char tmo[32];
+		ffs->live = 1;
+		ffs->fc->probesize = 32768;
+		ffs->fc->max_analyze_duration = AV_TIME_BASE / 2;
+		ffs->fc->flags |= AVFMT_FLAG_NOBUFFER;
+		/* socket timeout in microseconds */
+		snprintf(tmo, sizeof(tmo), "%ld", FFS_TIMEOUT * 1000l);
+		av_dict_set(&opts, "rw_timeout", tmo, 0);
+	}
+	ffs_rdue(ffs);
+	if (avformat_open_input(&ffs->fc, path, NULL, &opts))
+		goto failed;
+	av_dict_free(&opts);
+	ffs_rdue(ffs);
+	if (avformat_find_stream_info(ffs->fc, NULL) < 0)
+		goto failed;
+	if (ffs_open(ffs, flags))
+		goto failed;
 	return ffs;
 failed:
+	av_dict_free(&opts);
 	ffs_free(ffs);
 	return NULL;
 }
 
+/*
+ * Return another stream of the file of src; a pipe or a socket cannot
+ * be opened twice.  src demuxes for both and queues the packets of
+ * this stream, which is decoded only from its queue: when it is empty,
+ * ffs_adec() and ffs_vdec() return -1 as at the end of the file.
+ */
+struct ffs *ffs_peer(struct ffs *src, int flags)
+{
+	struct ffs *ffs;
+	ffs = malloc(sizeof(*ffs));
+	memset(ffs, 0, sizeof(*ffs));
+	ffs->si = -1;
+	ffs->speed = 1;
+	ffs->shared = 1;
+	ffs->fc = src->fc;
+	if (ffs_open(ffs, flags)) {
+		ffs_free(ffs);
+		return NULL;
+	}
+	src->peer = ffs;
+	return ffs;
+}
+
+static void ffs_qput(struct ffs *ffs, AVPacket *pkt)
+{
+	if (ffs->qn == FFS_QLEN) {	/* drop the oldest */
+		av_packet_free(&ffs->q[0]);
+		memmove(ffs->q, ffs->q + 1, --ffs->qn * sizeof(ffs->q[0]));
+	}
+	if ((ffs->q[ffs->qn] = av_packet_alloc()))
+		av_packet_move_ref(ffs->q[ffs->qn++], pkt);
+}
+
+static int ffs_qget(struct ffs *ffs, AVPacket *pkt)
+{
+	if (!ffs->qn)
+		return 0;
+	av_packet_move_ref(pkt, ffs->q[0]);
+	av_packet_free(&ffs->q[0]);
+	memmove(ffs->q, ffs->q + 1, --ffs->qn * sizeof(ffs->q[0]));
+	return 1;
+}
+
+/* read a packet; reads of live sources fail after FFS_TIMEOUT */
+static int ffs_read(struct ffs *ffs, AVPacket *pkt)
+{
+	ffs_rdue(ffs);
+	return av_read_frame(ffs->fc, pkt);
+}
+
 static AVPacket *ffs_pkt(struct ffs *ffs)
 {
 	AVPacket *pkt = &ffs->pkt;
-	while (av_read_frame(ffs->fc, pkt) >= 0) {
+	while (ffs_qget(ffs, pkt) || (!ffs->shared && ffs_read(ffs, pkt) >= 0)) {
 		if (pkt->stream_index == ffs->si) {
 			long pts = (pkt->dts == AV_NOPTS_VALUE ? 0 : pkt->dts) *
 				av_q2d(ffs->st->time_base) * 1000;
@@ -91,39 +239,23 @@ static AVPacket *ffs_pkt(struct ffs *ffs)
 				ffs->pts = pts;
 			return pkt;
 		}
+		if (ffs->peer && pkt->stream_index == ffs->peer->si)
+			ffs_qput(ffs->peer, pkt);
 		av_packet_unref(pkt);
 	}
 	return NULL;
 }
 
-static long ts_ms(void)
-{
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
-}
-
-static int wait(long ts, int vdelay)
+/* return the time (ts_ms()) at which the next frame should be shown */
+long ffs_wait(struct ffs *ffs)
 {
+	long vdelay = MAX(ffs->dur, 20) / ffs->speed;
 	long nts = ts_ms();
-	if (nts > ts && ts + vdelay > nts) {
-		struct timespec req;
-		req.tv_sec = 0;
-		req.tv_nsec = (ts + vdelay - nts) * 1000000;
-		struct timespec rem;
-		nanosleep(&req, &rem);
-		return 0;
-	}
-	return 1;
-}
-
-void ffs_wait(struct ffs *ffs)
-{
-	int vdelay = ffs->dur;
-	if (!wait(ffs->ts, MAX(vdelay, 20)))
-		ffs->ts += MAX(vdelay, 20);
+	if (nts >= ffs->ts && ffs->ts + vdelay > nts)
+		ffs->ts += vdelay;
 	else
-		ffs->ts = ts_ms();		/* out of sync */
+		ffs->ts = nts;		/* out of sync */
+	return ffs->ts;
 }
 
 /* audio/video frame offset difference */
@@ -144,30 +276,62 @@ void ffs_seek(struct ffs *ffs, struct ffs *vffs, long pos)
 	ffs->ts = 0;
 }
 
+void ffs_ainfo(struct ffs *ffs, int *rate, int *ch)
+{
+	*rate = ffs->cc->sample_rate;
+	*ch = ffs->cc->ch_layout.nb_channels;
+}
+
+/* seek to the key frame before pos and drop the frames in the decoder */
+void ffs_seekkey(struct ffs *ffs, struct ffs *vffs, long pos)
+{
+	av_seek_frame(ffs->fc, vffs->si,
+		pos / av_q2d(vffs->st->time_base) / 1000, AVSEEK_FLAG_BACKWARD);
+	avcodec_flush_buffers(ffs->cc);
+	ffs->ts = 0;
+}
+
+long ffs_fpos(struct ffs *ffs)
+{
+	return ffs->fts;
+}
+
 void ffs_vinfo(struct ffs *ffs, int *w, int *h)
 {
 	*h = ffs->cc->height;
 	*w = ffs->cc->width;
 }
 
+/* convert the last decoded frame; after ffs_vconf() it can be converted again */
+int ffs_vconv(struct ffs *ffs, void **buf)
+{
+	if (!ffs->tmp->data[0] || !ffs->dst->data[0])
+		return 0;
+	sws_scale(ffs->swsc, (void *) ffs->tmp->data, ffs->tmp->linesize,
+		  0, ffs->cc->height, ffs->dst->data, ffs->dst->linesize);
+	*buf = (void *) ffs->dst->data[0];
+	return ffs->dst->linesize[0];
+}
+
 int ffs_vdec(struct ffs *ffs, void **buf)
 {
 	AVCodecContext *vcc = ffs->cc;
 	AVPacket *pkt = ffs_pkt(ffs);
 	if (!pkt)
 		return -1;
-	if (avcodec_send_packet(vcc, pkt) < 0)
+	if (avcodec_send_packet(vcc, pkt) < 0) {
+		av_packet_unref(pkt);
 		return 0;
+	}
+	av_packet_unref(pkt);
 	if (avcodec_receive_frame(vcc, ffs->tmp) < 0)
 		return 0;
-	av_packet_unref(pkt);
-	if (buf) {
-		sws_scale(ffs->swsc, (void *) ffs->tmp->data, ffs->tmp->linesize,
-			  0, vcc->height, ffs->dst->data, ffs->dst->linesize);
-		*buf = (void *) ffs->dst->data[0];
-		return ffs->dst->linesize[0];
-	}
-	return 0;
+	if (ffs->tmp->best_effort_timestamp != AV_NOPTS_VALUE)
+		ffs->fts = ffs->tmp->best_effort_timestamp *
+			av_q2d(ffs->st->time_base) * 1000;
+	else
+		ffs->fts = ffs->pts;
+	return buf ? ffs_vconv(ffs, buf) : 0;
 }
 
 int ffs_sdec(struct ffs *ffs, char *buf, int blen, long *beg, long *end)
@@ -207,13 +371,28 @@ static int ffs_bytespersample(struct ffs *ffs)
 	return av_get_bytes_per_sample(FFS_SAMPLEFMT) * ffs->cc->ch_layout.nb_channels;
 }
 
+static int ffs_aconv(struct ffs *ffs, AVFrame *frame, char *buf, int blen)
+{
+	uint8_t *out[] = {(uint8_t *) buf};
+	int len = swr_convert(ffs->swrc, out, blen / ffs_bytespersample(ffs),
+		frame ? (void *) frame->extended_data : NULL,
+		frame ? frame->nb_samples : 0);
+	return len > 0 ? len * ffs_bytespersample(ffs) : 0;
+}
+
 int ffs_adec(struct ffs *ffs, char *buf, int blen)
 {
 	int rdec = 0;
 	AVPacket tmppkt = {0};
-	AVPacket *pkt = ffs_pkt(ffs);
-	uint8_t *out[] = {NULL};
-	if (!pkt)
+	AVPacket *pkt;
+	/*
+	 * Samples that did not fit into the previous buffer are kept by
+	 * swresample and returned before decoding more packets.  ffs_aconf()
+	 * does not resample, so this does not flush a resampler.
+	 */
+	if (swr_get_out_samples(ffs->swrc, 0) > 0)
+		return ffs_aconv(ffs, NULL, buf, blen);
+	if (!(pkt = ffs_pkt(ffs)))
 		return -1;
 	tmppkt.size = pkt->size;
 	tmppkt.data = pkt->data;
@@ -225,12 +404,14 @@ int ffs_adec(struct ffs *ffs, char *buf, int blen)
 	        int len = av_get_bytes_per_sample(ffs->cc->sample_fmt);
 		tmppkt.size -= len;
 		tmppkt.data += len;
-		out[0] = (uint8_t*)buf + rdec;
-		len = swr_convert(ffs->swrc,
-			out, (blen - rdec) / ffs_bytespersample(ffs),
-			(void *) ffs->tmp->extended_data, ffs->tmp->nb_samples);
-		if (len > 0)
-			rdec += len * ffs_bytespersample(ffs);
+		if (!ffs->fg) {
+			rdec += ffs_aconv(ffs, ffs->tmp, buf + rdec, blen - rdec);
+		} else if (av_buffersrc_add_frame(ffs->fsrc, ffs->tmp) >= 0) {
+			while (av_buffersink_get_frame(ffs->fsink, ffs->flt) >= 0) {
+				rdec += ffs_aconv(ffs, ffs->flt, buf + rdec, blen - rdec);
+				av_frame_unref(ffs->flt);
+			}
+		}
 	}
 	av_packet_unref(pkt);
 	return rdec;
@@ -240,6 +421,8 @@ static int fbm2pixfmt(int fbm)
 {
 	switch (fbm & 0x0fff) {
 	case 0x888:
+		if (FBM_BPP(fbm) == 3)
+			return FBM_ORD(fbm) == 7 ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_BGR24;
 		return AV_PIX_FMT_RGB32;
 	case 0x565:
 		return AV_PIX_FMT_RGB565;
@@ -257,14 +440,18 @@ void ffs_vconf(struct ffs *ffs, float zoom, int fbm)
 	int w = ffs->cc->width;
 	int fmt = ffs->cc->pix_fmt;
 	int pixfmt = fbm2pixfmt(fbm);
-	uint8_t *buf = NULL;
 	int n;
-	ffs->swsc = sws_getContext(w, h, fmt, w * zoom, h * zoom,
+	ffs->swsc = sws_getCachedContext(ffs->swsc, w, h, fmt, w * zoom, h * zoom,
 			pixfmt, SWS_FAST_BILINEAR,
 			NULL, NULL, NULL);
+	/* the buffer is reallocated only if it grows; configure the largest zoom first */
 	n = av_image_get_buffer_size(pixfmt, w * zoom, h * zoom, 16);
-	buf = av_malloc(n * sizeof(uint8_t));
-	av_image_fill_arrays(ffs->dst->data, ffs->dst->linesize, buf, pixfmt,
+	if (n > ffs->dlen) {
+		av_free(ffs->dbuf);
+		ffs->dbuf = av_malloc(n * sizeof(uint8_t));
+		ffs->dlen = ffs->dbuf ? n : 0;
+	}
+	av_image_fill_arrays(ffs->dst->data, ffs->dst->linesize, ffs->dbuf, pixfmt,
 				w * zoom, h * zoom, 1);
 }
 
@@ -281,6 +468,56 @@ void ffs_aconf(struct ffs *ffs)
 	swr_init(ffs->swrc);
 }
 
+/* skip decoding the frames no other frame depends on */
+void ffs_skip(struct ffs *ffs, int skip)
+{
+	ffs->cc->skip_frame = skip ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
+/* change playback speed; audio is time-stretched by libavfilter's atempo */
+int ffs_speed(struct ffs *ffs, float speed)
+{
+	AVFilterContext *atempo;
+	char args[256];
+	char layout[64];
+	ffs->speed = speed;
+	if (ffs->cc->codec_type == AVMEDIA_TYPE_VIDEO) {
+		ffs_skip(ffs, speed >= 2);
+		return 0;
+	}
+	if (ffs->fg)
+		avfilter_graph_free(&ffs->fg);
+	if (speed == 1)
+		return 0;
+	if (!ffs->flt)
+		ffs->flt = av_frame_alloc();
+	ffs->fg = avfilter_graph_alloc();
+	av_channel_layout_describe(&ffs->cc->ch_layout, layout, sizeof(layout));
+	snprintf(args, sizeof(args),
+		"time_base=1/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
+		ffs->cc->sample_rate, ffs->cc->sample_rate,
+		av_get_sample_fmt_name(ffs->cc->sample_fmt), layout);
+	if (avfilter_graph_create_filter(&ffs->fsrc, avfilter_get_by_name("abuffer"),
+			"in", args, NULL, ffs->fg) < 0)
+		goto failed;
+	snprintf(args, sizeof(args), "tempo=%g", speed);
+	if (avfilter_graph_create_filter(&atempo, avfilter_get_by_name("atempo"),
+			"atempo", args, NULL, ffs->fg) < 0)
+		goto failed;
+	if (avfilter_graph_create_filter(&ffs->fsink, avfilter_get_by_name("abuffersink"),
+			"out", NULL, NULL, ffs->fg) < 0)
+		goto failed;
+	if (avfilter_link(ffs->fsrc, 0, atempo, 0) < 0 ||
+			avfilter_link(atempo, 0, ffs->fsink, 0) < 0 ||
+			avfilter_graph_config(ffs->fg, NULL) < 0)
+		goto failed;
+	return 0;
+failed:
+	fprintf(stderr, "ffs: atempo setup failed\n");
+	avfilter_graph_free(&ffs->fg);
+	return 1;
+}
+
 void ffs_globinit(void)
 {
 	avformat_network_init();
@@ -6,8 +6,13 @@
  *
  * This program is released under the Modified BSD license.
  */
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
 #include <pty.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -15,7 +20,6 @@
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
-#include <poll.h>
 #include <alsa/asoundlib.h>
 #include <pthread.h>
 #include <sys/time.h>
@@ -26,10 +30,23 @@
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
 #include <linux/fb.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "draw.c"
+#include "shm.c"
 #include "ffs.c"
+#include "thumb.c"
+#include "mosaic.c"
 
 static int paused;
 static int exited;
@@ -40,13 +57,20 @@ static int arg;
 static char filename[32];
 
 static float zoom = 1;
+static float zoom_max;		/* vffs's buffer is allocated for this zoom */
+static float zoom_cmd;		/* the zoom given with -z */
+static float speed = 1;		/* playback speed */
 static int magnify = 1;
 static int jump = 0;
 static int fullscreen = 0;
 static int video = 1;		/* video stream; 0:none, 1:auto, >1:idx */
 static int audio = 1;		/* audio stream; 0:none, 1:auto, >1:idx */
+static int mosaic;		/* tiled streams; 0:off, 1:no audio, >1:audio tile */
 static int posx, posy;		/* video position */
 static int rjust, bjust;	/* justify video to screen right/bottom */
+static int rotate;		/* clockwise video rotation in degrees */
+static int live;		/* live source; the maximum latency in milliseconds */
+static char *sink;		/* shared memory output instead of fb; see shm.c */
 
 static struct ffs *affs;	/* audio ffmpeg stream */
 static struct ffs *vffs;	/* video ffmpeg stream */
@@ -54,6 +78,12 @@ static char *adevice = "default";/* alsa playback device */
 static snd_pcm_t *ahandle;	/* alsa handle */
 static pthread_t a_thread;	/* alsa thread */
 static int vnum;		/* decoded video frame count */
+static void *vbuf;		/* decoded video frame waiting to be shown */
+static int vlen;		/* line length of vbuf; zero if none */
+static long vdue;		/* when to show vbuf or read the next packet */
+static long vshown;		/* timestamp of the displayed frame */
+static int stepped;		/* a frame was shown by stepping */
+static int reverse;		/* slow reverse playback */
 static long mark[256];		/* marks */
 
 static int sync_diff;		/* audio/video frame position diff */
@@ -63,13 +93,110 @@ static int sync_cnt = 32;	/* synchronization steps */
 static int sync_cur;		/* synchronization steps left */
 static int sync_first;		/* first frame to record sync_diff */
 
-static void stroll(void)
+/* event loop */
+
+#define EV_INPUT	0x01		/* stdin is readable */
+#define EV_TIMER	0x02		/* frame deadline reached */
+#define EV_AUDIO	0x04		/* audio buffers were consumed */
+
+static int ev_fd = -1;			/* epoll descriptor */
+static int ev_tfd = -1;			/* frame deadline timerfd */
+static int ev_afd = -1;			/* audio thread to main loop eventfd */
+static int ev_pfd = -1;			/* main loop to audio thread eventfd */
+static int ev_in;			/* stdin is watched */
+static long ev_due;			/* armed timer deadline */
+
+static int ev_add(int fd)
+{
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(ev_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int ev_init(void)
+{
+	ev_fd = epoll_create1(EPOLL_CLOEXEC);
+	ev_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	ev_afd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ev_pfd = eventfd(0, EFD_CLOEXEC);
+	if (ev_fd < 0 || ev_tfd < 0 || ev_afd < 0 || ev_pfd < 0) {
+		perror("ev_init()");
+		return 1;
+	}
+	ev_add(ev_tfd);
+	ev_add(ev_afd);
+	/* regular files cannot be polled; they are always readable */
+	ev_in = !ev_add(0);
+	return 0;
+}
+
+static void ev_free(void)
+{
+	close(ev_pfd);
+	close(ev_afd);
+	close(ev_tfd);
+	close(ev_fd);
+}
+
+/* stop watching stdin; called after a hangup */
+static void ev_hangup(void)
+{
+	if (ev_in)
+		epoll_ctl(ev_fd, EPOLL_CTL_DEL, 0, NULL);
+	ev_in = 0;
+}
+
+static void ev_post(int fd)
+{
+	uint64_t n = 1;
+	if (write(fd, &n, sizeof(n)) < 0)
+		perror("ev_post()");
+}
+
+/* block until ev_post(fd) */
+static void ev_get(int fd)
+{
+	uint64_t n;
+	if (read(fd, &n, sizeof(n)) < 0)
+		n = 0;
+}
+
+/* fire EV_TIMER at ts_ms() time ts; zero disarms the timer */
+static void ev_timer(long ts)
+{
+	struct itimerspec its = {{0}};
+	if (ts == ev_due)
+		return;
+	its.it_value.tv_sec = ts / 1000;
+	its.it_value.tv_nsec = (ts % 1000) * 1000000;
+	timerfd_settime(ev_tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	ev_due = ts;
+}
+
+static int hs_on;			/* the test harness is running */
+static int hs_wait(int timeout);
+
+/* wait at most timeout milliseconds (-1 for ever) for an event */
+static int ev_wait(int timeout)
 {
-	struct timespec req;
-	req.tv_sec = 0;
-	req.tv_nsec = 10000000;
-	struct timespec rem;
-	nanosleep(&req, &rem);
+	struct epoll_event evs[4];
+	uint64_t n;
+	int ret = 0;
+	int cnt, i;
+	if (hs_on)
+		return hs_wait(timeout);
+	cnt = epoll_wait(ev_fd, evs, 4, timeout);
+	for (i = 0; i < cnt; i++) {
+		int fd = evs[i].data.fd;
+		if (fd == 0)
+			ret |= EV_INPUT;
+		if (fd == ev_tfd && read(fd, &n, sizeof(n)) > 0)
+			ret |= EV_TIMER;
+		if (fd == ev_afd && read(fd, &n, sizeof(n)) > 0)
+			ret |= EV_AUDIO;
+	}
+	return ret;
 }
 
 static void draw_row(int rb, int cb, char *img, int cn)
@@ -87,6 +214,150 @@ static void draw_row(int rb, int cb, char *img, int cn)
 	memcpy(fb_mem(rb) + cb * bpp, img, cn * bpp);
 }
 
+/* rotated output */
+
+#define RTILE		32		/* rotation tile size in pixels */
+
+/* the source of the destination pixel (0, 0) and source steps along x and y */
+static char *rot_map(char *img, int linelen, int w, int h, int bpp, int *xs, int *ys)
+{
+	switch (rotate) {
+	case 90:
+		*xs = -linelen;
+		*ys = bpp;
+		return img + (h - 1) * linelen;
+	case 180:
+		*xs = -bpp;
+		*ys = -linelen;
+		return img + (h - 1) * linelen + (w - 1) * bpp;
+	default:
+		*xs = linelen;
+		*ys = -bpp;
+		return img + (w - 1) * bpp;
+	}
+}
+
+/* copy destination pixels [x, x + bw) x [y, y + bh) one by one */
+static void rot_px(char *s0, int xs, int ys, int bpp, int x, int y, int bw, int bh, int cb, int rb)
+{
+	int i, j;
+	for (i = y; i < y + bh; i++) {
+		char *d = fb_mem(rb + i) + (cb + x) * bpp;
+		char *s = s0 + (i / magnify) * ys;
+		for (j = x; j < x + bw; j++, d += bpp) {
+			/* with a constant size, memcpy() becomes a single move */
+			if (bpp == 4)
+				memcpy(d, s + (j / magnify) * xs, 4);
+			else if (bpp == 2)
+				memcpy(d, s + (j / magnify) * xs, 2);
+			else
+				memcpy(d, s + (j / magnify) * xs, bpp);
+		}
+	}
+}
+
+#ifdef __SSE2__
+/* rot_px() for 90 and 270 degrees with 4x4 transposes; bw and bh are multiples of 4 */
+static void rot_sse32(char *s0, int xs, int ys, int x, int y, int bw, int bh, int cb, int rb)
+{
+	__m128i r0, r1, r2, r3, t0, t1, t2, t3, o[4];
+	int i, j, k;
+	for (i = y; i < y + bh; i += 4) {
+		for (j = x; j < x + bw; j += 4) {
+			/* the lowest address of the four source pixels of each column */
+			char *s = s0 + j * xs + i * ys + (ys < 0 ? 3 * ys : 0);
+			r0 = _mm_loadu_si128((void *) s);
+			r1 = _mm_loadu_si128((void *) (s + xs));
+			r2 = _mm_loadu_si128((void *) (s + 2 * xs));
+			r3 = _mm_loadu_si128((void *) (s + 3 * xs));
+			t0 = _mm_unpacklo_epi32(r0, r1);
+			t1 = _mm_unpacklo_epi32(r2, r3);
+			t2 = _mm_unpackhi_epi32(r0, r1);
+			t3 = _mm_unpackhi_epi32(r2, r3);
+			o[0] = _mm_unpacklo_epi64(t0, t1);
+			o[1] = _mm_unpackhi_epi64(t0, t1);
+			o[2] = _mm_unpacklo_epi64(t2, t3);
+			o[3] = _mm_unpackhi_epi64(t2, t3);
+			for (k = 0; k < 4; k++)
+				_mm_storeu_si128((void *) (fb_mem(rb + i + (ys < 0 ? 3 - k : k)) +
+					(cb + j) * 4), o[k]);
+		}
+	}
+}
+
+/* rot_sse32() for 16 bpp with 8x8 transposes; bw and bh are multiples of 8 */
+static void rot_sse16(char *s0, int xs, int ys, int x, int y, int bw, int bh, int cb, int rb)
+{
+	__m128i r[8], t[8], o[8];
+	int i, j, k;
+	for (i = y; i < y + bh; i += 8) {
+		for (j = x; j < x + bw; j += 8) {
+			char *s = s0 + j * xs + i * ys + (ys < 0 ? 7 * ys : 0);
+			for (k = 0; k < 8; k++)
+				r[k] = _mm_loadu_si128((void *) (s + k * xs));
+			for (k = 0; k < 4; k++) {
+				t[k] = _mm_unpacklo_epi16(r[2 * k], r[2 * k + 1]);
+				t[k + 4] = _mm_unpackhi_epi16(r[2 * k], r[2 * k + 1]);
+			}
+			/* t[0..3]: columns 0-3 of row pairs; t[4..7]: columns 4-7 */
+			r[0] = _mm_unpacklo_epi32(t[0], t[1]);
+			r[1] = _mm_unpackhi_epi32(t[0], t[1]);
+			r[2] = _mm_unpacklo_epi32(t[4], t[5]);
+			r[3] = _mm_unpackhi_epi32(t[4], t[5]);
+			r[4] = _mm_unpacklo_epi32(t[2], t[3]);
+			r[5] = _mm_unpackhi_epi32(t[2], t[3]);
+			r[6] = _mm_unpacklo_epi32(t[6], t[7]);
+			r[7] = _mm_unpackhi_epi32(t[6], t[7]);
+			for (k = 0; k < 4; k++) {
+				o[2 * k] = _mm_unpacklo_epi64(r[k], r[k + 4]);
+				o[2 * k + 1] = _mm_unpackhi_epi64(r[k], r[k + 4]);
+			}
+			for (k = 0; k < 8; k++)
+				_mm_storeu_si128((void *) (fb_mem(rb + i + (ys < 0 ? 7 - k : k)) +
+					(cb + j) * 2), o[k]);
+		}
+	}
+}
+#endif
+
+/* copy one destination tile; the transposes stay within a few cache lines */
+static void rot_tile(char *s0, int xs, int ys, int bpp, int x, int y, int bw, int bh, int cb, int rb)
+{
+#ifdef __SSE2__
+	int n = bpp == 4 ? 4 : 8;
+	int nw = bw / n * n;
+	int nh = bh / n * n;
+	if (magnify == 1 && (ys == bpp || ys == -bpp) && (bpp == 4 || bpp == 2)) {
+		if (bpp == 4)
+			rot_sse32(s0, xs, ys, x, y, nw, nh, cb, rb);
+		else
+			rot_sse16(s0, xs, ys, x, y, nw, nh, cb, rb);
+		rot_px(s0, xs, ys, bpp, x + nw, y, bw - nw, bh, cb, rb);
+		rot_px(s0, xs, ys, bpp, x, y + nh, nw, bh - nh, cb, rb);
+		return;
+	}
+#endif
+	rot_px(s0, xs, ys, bpp, x, y, bw, bh, cb, rb);
+}
+
+/* draw the w x h frame rotated; a naive rotation would thrash the cache */
+static void draw_rotated(char *img, int linelen, int w, int h)
+{
+	int bpp = FBM_BPP(fb_mode());
+	int dw = (rotate == 180 ? w : h) * magnify;
+	int dh = (rotate == 180 ? h : w) * magnify;
+	int cb = rjust ? fb_cols() - dw + posx : posx;
+	int rb = bjust ? fb_rows() - dh + posy : posy;
+	int x0 = MAX(0, -cb), x1 = MIN(dw, fb_cols() - cb);
+	int y0 = MAX(0, -rb), y1 = MIN(dh, fb_rows() - rb);
+	int xs, ys, x, y;
+	char *s0 = rot_map(img, linelen, w, h, bpp, &xs, &ys);
+	for (y = y0; y < y1; y += RTILE)
+		for (x = x0; x < x1; x += RTILE)
+			rot_tile(s0, xs, ys, bpp, x, y,
+				MIN(RTILE, x1 - x), MIN(RTILE, y1 - y), cb, rb);
+}
+
 static void draw_frame(char *img, int linelen)
 {
 	int w, h, rn, cn, cb, rb;
@@ -95,6 +366,10 @@ static void draw_frame(char *img, int linelen)
 	ffs_vinfo(vffs, &w, &h);
 	rn = h * zoom;
 	cn = w * zoom;
+	if (rotate) {
+		draw_rotated(img, linelen, cn, rn);
+		return;
+	}
 	cb = rjust ? fb_cols() - cn * magnify + posx : posx;
 	rb = bjust ? fb_rows() - rn * magnify + posy : posy;
 	if (magnify == 1) {
@@ -116,77 +391,573 @@ static void draw_frame(char *img, int linelen)
 	}
 }
 
+/* the zoom to fit the video to the screen */
+static float zoom_fit(void)
+{
+	int w, h;
+	float hz, wz;
+	ffs_vinfo(vffs, &w, &h);
+	if (rotate % 180) {
+		int t = w;
+		w = h;
+		h = t;
+	}
+	hz = (float) fb_rows() / h / magnify;
+	wz = (float) fb_cols() / w / magnify;
+	return hz < wz ? hz : wz;
+}
+
+static void draw_clear(void)
+{
+	int r;
+	if (sink) {
+		sk_clear();
+		return;
+	}
+	for (r = 0; r < fb_rows(); r++)
+		memset(fb_mem(r), 0, fb_cols() * FBM_BPP(fb_mode()));
+}
+
+/* decoded frames for stepping */
+
+static int fc_mb = 128;			/* frame cache limit in megabytes */
+static char **fc_buf;			/* frame buffers ordered by fc_pts */
+static long *fc_pts;			/* frame timestamps */
+static int fc_cnt;			/* number of cached frames */
+static int fc_max;			/* fc_buf length */
+static int fc_ll;			/* line length of cached frames */
+static long fc_len;			/* bytes per cached frame */
+
+static void fc_free(void)
+{
+	int i;
+	for (i = 0; i < fc_max; i++)
+		free(fc_buf[i]);
+	free(fc_buf);
+	free(fc_pts);
+	fc_buf = NULL;
+	fc_pts = NULL;
+	fc_cnt = 0;
+	fc_max = 0;
+}
+
+/* append a frame; the oldest is dropped when the cache is full */
+static void fc_put(char *img, int linelen, long pts)
+{
+	int w, h;
+	char *buf;
+	ffs_vinfo(vffs, &w, &h);
+	if (linelen != fc_ll || (long) linelen * (int) (h * zoom) != fc_len) {
+		fc_free();
+		fc_ll = linelen;
+		fc_len = (long) linelen * (int) (h * zoom);
+		fc_max = MAX(2, ((long) fc_mb << 20) / fc_len);
+		fc_buf = calloc(fc_max, sizeof(fc_buf[0]));
+		fc_pts = calloc(fc_max, sizeof(fc_pts[0]));
+	}
+	if (fc_cnt == fc_max) {
+		buf = fc_buf[0];
+		memmove(fc_buf, fc_buf + 1, (fc_max - 1) * sizeof(fc_buf[0]));
+		memmove(fc_pts, fc_pts + 1, (fc_max - 1) * sizeof(fc_pts[0]));
+		fc_buf[--fc_cnt] = buf;
+	}
+	if (!fc_buf[fc_cnt] && !(fc_buf[fc_cnt] = malloc(fc_len)))
+		return;
+	memcpy(fc_buf[fc_cnt], img, fc_len);
+	fc_pts[fc_cnt++] = pts;
+}
+
+static int fc_find(long pts)
+{
+	int i;
+	for (i = fc_cnt - 1; i >= 0; i--)
+		if (fc_pts[i] == pts)
+			return i;
+	return -1;
+}
+
+/* decode the frames before pos into the cache; return the last one or -1 */
+static int fc_fill(long pos)
+{
+	long beg = pos - 1;
+	void *buf;
+	int ret, i;
+	vlen = 0;
+	for (i = 0; i < 8; i++) {
+		fc_cnt = 0;
+		ffs_seekkey(vffs, vffs, MAX(0, beg));
+		while ((ret = ffs_vdec(vffs, &buf)) >= 0) {
+			if (ret > 0)
+				fc_put(buf, ret, ffs_fpos(vffs));
+			if (ret > 0 && ffs_fpos(vffs) >= pos)
+				break;
+		}
+		for (ret = fc_cnt - 1; ret >= 0; ret--)
+			if (fc_pts[ret] < pos)
+				return ret;
+		/* the key frame was not before pos; seek further back */
+		if (beg <= 0)
+			break;
+		beg -= 1000 << i;
+	}
+	return -1;
+}
+
+/* live sources */
+
+#define LV_RESET	5000		/* a larger latency means a timestamp jump */
+
+static long lv_base = LONG_MAX;		/* the smallest time minus frame timestamp */
+static long lv_lat;			/* latency of the last frame in milliseconds */
+
+/*
+ * The clock of the sender is unknown; the latency is measured relative
+ * to the earliest a frame was ever decoded or shown.
+ */
+static void lv_update(long pts)
+{
+	long d = ts_ms() - pts;
+	if (d < lv_base || d - lv_base > LV_RESET)
+		lv_base = d;
+	lv_lat = d - lv_base;
+}
+
+/* real-time settings */
+
+static int rt_prio;			/* SCHED_FIFO priority of the audio thread */
+static int rt_lock;			/* lock fvp's memory */
+static cpu_set_t rt_acpu;		/* audio thread cpus */
+static cpu_set_t rt_vcpu;		/* decoding and drawing cpus */
+
+/* parse a cpu list like 0,2-3; return the first unread character */
+static char *rt_cpus(char *s, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	while (isdigit((unsigned char) *s)) {
+		int beg = strtol(s, &s, 10);
+		int end = *s == '-' ? strtol(s + 1, &s, 10) : beg;
+		for (; beg <= end && beg < CPU_SETSIZE; beg++)
+			CPU_SET(beg, set);
+		if (*s == ',')
+			s++;
+	}
+	return s;
+}
+
+/* start the audio thread with the requested priority and cpus */
+static int rt_thread(pthread_t *thr, void *(*fn)(void *))
+{
+	pthread_attr_t attr;
+	struct sched_param sp = {0};
+	int err = -1;
+	if (rt_prio > 0 && !pthread_attr_init(&attr)) {
+		sp.sched_priority = rt_prio;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &sp);
+		err = pthread_create(thr, &attr, fn, NULL);
+		pthread_attr_destroy(&attr);
+		if (err == EPERM || err == EINVAL) {
+			printf("fvp: SCHED_FIFO %d: %s; see RLIMIT_RTPRIO\n",
+				rt_prio, strerror(err));
+			rt_prio = 0;
+		}
+	}
+	if (err && (err = pthread_create(thr, NULL, fn, NULL)))
+		return err;
+	if (CPU_COUNT(&rt_acpu) && pthread_setaffinity_np(*thr, sizeof(rt_acpu), &rt_acpu)) {
+		printf("fvp: cannot pin the audio thread\n");
+		CPU_ZERO(&rt_acpu);
+	}
+	return 0;
+}
+
+/* lock the pages of fvp and fault in those of the stack */
+static void rt_mlock(void)
+{
+	volatile char stack[1 << 17];
+	struct rlimit rl;
+	int i;
+	/* without CAP_IPC_LOCK, later allocations would fail past RLIMIT_MEMLOCK */
+	int future = !geteuid() || (!getrlimit(RLIMIT_MEMLOCK, &rl) &&
+			rl.rlim_cur == RLIM_INFINITY);
+	if (mlockall(MCL_CURRENT | (future ? MCL_FUTURE : 0)) < 0) {
+		printf("fvp: mlockall: %s; see RLIMIT_MEMLOCK\n", strerror(errno));
+		return;
+	}
+	if (!future)
+		printf("fvp: memory allocated after startup is not locked\n");
+	for (i = 0; i < (int) sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
 /* audio buffers */
 
-#define ABUFCNT		(1 << 3)	/* number of audio buffers */
-#define ABUFLEN		(1 << 18)	/* audio buffer length */
+static char *a_buf;			/* audio ring buffer */
+static long a_size;			/* a_buf size in bytes */
+static unsigned long a_rd;		/* bytes played */
+static unsigned long a_wr;		/* bytes decoded */
+static int a_fsz;			/* bytes per audio frame */
+static int a_ms;			/* a_buf length in milliseconds */
+static long a_lo, a_hi;			/* decoding water marks */
+static int a_filling;			/* decoding until a_hi */
+static unsigned a_latency = 500000;	/* alsa buffer length in microseconds */
+static int a_mmap;			/* decode into alsa's mmap()ed buffer */
+static int a_eof;			/* no more audio to decode */
+static int a_canpause;			/* the device supports snd_pcm_pause() */
+static int a_held;			/* paused with snd_pcm_pause() */
+static pthread_mutex_t a_lock = PTHREAD_MUTEX_INITIALIZER;	/* affs in mmap mode */
 
-static int a_cons;
-static int a_prod;
-static char a_buf[ABUFCNT][ABUFLEN];
-static int a_len[ABUFCNT];
+/*
+ * a_wr is advanced by the decoder after filling a_buf and a_rd by the
+ * player after consuming it; release and acquire order the samples.
+ */
+static long a_used(void)
+{
+	return __atomic_load_n(&a_wr, __ATOMIC_ACQUIRE) - __atomic_load_n(&a_rd, __ATOMIC_ACQUIRE);
+}
 
 static int a_conswait(void)
 {
-	return a_cons == a_prod;
+	return a_used() == 0;
+}
+
+static void a_advance(unsigned long *idx, long n)
+{
+	__atomic_store_n(idx, *idx + n, __ATOMIC_RELEASE);
 }
 
-static int a_prodwait(void)
+/* allocate a_buf for ms milliseconds; lo is the fraction for a_lo in 1/16 */
+static int a_init(int ms, int lo)
 {
-	return ((a_prod + 1) & (ABUFCNT - 1)) == a_cons;
+	int rate, ch;
+	ffs_ainfo(affs, &rate, &ch);
+	a_fsz = 2 * ch;
+	a_hi = MAX((long) ms * rate / 1000, 4096) * a_fsz;
+	a_lo = a_hi / 16 * lo;
+	/* room for the samples in alsa's buffer; see alsa_pause() */
+	a_size = a_hi + (long long) a_latency * rate / 1000000 * a_fsz;
+	/* alsa_open() allocates it if mmap access is unavailable */
+	if (!a_mmap)
+		a_buf = malloc(a_size);
+	return !a_mmap && !a_buf;
+}
+
+/* decode packets into a_buf once it drops below a_lo, until it reaches a_hi */
+static int a_fill(void)
+{
+	int ret = 0;
+	if (a_mmap || a_eof || (!a_filling && a_used() > a_lo))
+		return 0;
+	a_filling = 1;
+	while (a_used() < a_hi) {
+		long off = a_wr % a_size;
+		/* a packet may span the end of a_buf; ffs_adec() keeps the rest */
+		ret = ffs_adec(affs, a_buf + off, MIN(a_hi - a_used(), a_size - off));
+		/* with video, the audio packets of live sources are queued by vffs */
+		if (ret < 0 && live && video)
+			return 0;
+		if (ret < 0) {
+			a_eof = 1;
+			return ret;
+		}
+		if (ret > 0) {
+			/*
+			 * The audio thread sleeps on ev_pfd only when a_buf is
+			 * empty; a_used() may be stale by what it played since,
+			 * which is far less than a_lo.
+			 */
+			int wake = a_used() <= a_lo;
+			a_advance(&a_wr, ret);
+			if (wake)
+				ev_post(ev_pfd);
+		}
+	}
+	a_filling = 0;
+	return ret;
+}
+
+/* sleep until alsa can take avail_min frames or ev_pfd is posted */
+static void alsa_wait(void)
+{
+	struct pollfd pfds[16];
+	unsigned short revents;
+	int n = snd_pcm_poll_descriptors(ahandle, pfds,
+			sizeof(pfds) / sizeof(pfds[0]) - 1);
+	if (n < 0) {
+		snd_pcm_wait(ahandle, 1000);
+		return;
+	}
+	pfds[n].fd = ev_pfd;
+	pfds[n].events = POLLIN;
+	while (!exited) {
+		if (poll(pfds, n + 1, 1000) <= 0)
+			return;
+		if (pfds[n].revents & POLLIN) {
+			ev_get(ev_pfd);
+			return;
+		}
+		if (snd_pcm_poll_descriptors_revents(ahandle, pfds, n, &revents) < 0 ||
+				revents & (POLLOUT | POLLERR))
+			return;
+	}
 }
 
 static void *process_audio(void *dat)
 {
 	while (!exited) {
+		snd_pcm_sframes_t avail;
+		long off, used, len;
+		int frames;
 		while (!exited && (a_conswait() || paused))
-			stroll();
-		if (ahandle) {
-			/* period of 4 */
-			int frames = snd_pcm_writei(ahandle, a_buf[a_cons], a_len[a_cons] / 4);
-			if (frames < 0) {
-				frames = snd_pcm_recover(ahandle, frames, 0);
-				printf("snd_pcm_writei failed: %s\n", snd_strerror(frames));
-			} else if (frames < a_len[a_cons] / 4)
-				printf("Short write (expected %d, wrote %d)\n", a_len[a_cons] / 4, frames);
-			a_cons = (a_cons + 1) & (ABUFCNT - 1);
+			ev_get(ev_pfd);
+		if (exited || !ahandle)
+			break;
+		alsa_wait();
+		if ((avail = snd_pcm_avail_update(ahandle)) < 0) {
+			avail = snd_pcm_recover(ahandle, avail, 0);
+			if (avail < 0)
+				printf("snd_pcm_avail_update failed: %s\n", snd_strerror(avail));
+			continue;
+		}
+		off = a_rd % a_size;
+		used = a_used();
+		len = MIN(used, a_size - off);
+		frames = snd_pcm_writei(ahandle, a_buf + off, MIN(avail, len / a_fsz));
+		/* after an underrun, write the same samples again */
+		if (frames < 0 && (frames = snd_pcm_recover(ahandle, frames, 0)) < 0) {
+			printf("snd_pcm_writei failed: %s\n", snd_strerror(frames));
+			frames = MIN(avail, len / a_fsz);
 		}
+		a_advance(&a_rd, frames * a_fsz);
+		/* wake the decoder when crossing a_lo and when empty */
+		if ((a_used() <= a_lo && used > a_lo) || !a_used())
+			ev_post(ev_afd);
 	}
 	return NULL;
 }
 
-static int alsa_open(void)
+static void alsa_start(void)
+{
+	if (snd_pcm_state(ahandle) == SND_PCM_STATE_PREPARED)
+		snd_pcm_start(ahandle);
+}
+
+/*
+ * With -M the audio thread decodes straight into the mmap()ed buffer
+ * of alsa, skipping a_buf and a copy per sample.  It fills the whole
+ * buffer, starts the device if needed, and sleeps until avail_min
+ * frames are free again.
+ */
+static void *process_mmap(void *dat)
 {
+	while (!exited) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t off, frames;
+		snd_pcm_sframes_t avail;
+		char *dst;
+		int len, err;
+		if (a_eof) {
+			ev_get(ev_pfd);
+			continue;
+		}
+		if ((avail = snd_pcm_avail_update(ahandle)) < 0) {
+			if ((err = snd_pcm_recover(ahandle, avail, 0)) < 0) {
+				printf("snd_pcm_avail_update failed: %s\n", snd_strerror(err));
+				alsa_wait();
+			}
+			continue;
+		}
+		if (!avail) {
+			alsa_start();
+			if (video)
+				ev_post(ev_afd);
+			alsa_wait();
+			continue;
+		}
+		frames = avail;
+		if ((err = snd_pcm_mmap_begin(ahandle, &areas, &off, &frames)) < 0) {
+			if ((err = snd_pcm_recover(ahandle, err, 0)) < 0) {
+				printf("snd_pcm_mmap_begin failed: %s\n", snd_strerror(err));
+				alsa_wait();
+			}
+			continue;
+		}
+		dst = (char *) areas[0].addr + areas[0].first / 8 + off * (areas[0].step / 8);
+		pthread_mutex_lock(&a_lock);
+		len = ffs_adec(affs, dst, frames * a_fsz);
+		pthread_mutex_unlock(&a_lock);
+		err = snd_pcm_mmap_commit(ahandle, off, len > 0 ? len / a_fsz : 0);
+		if (err < 0)
+			snd_pcm_recover(ahandle, err, 0);
+		if (len < 0) {
+			alsa_start();
+			a_eof = 1;
+			ev_post(ev_afd);
+		}
+	}
+	return NULL;
+}
+
+/* wake up only after half of alsa's buffer is played */
+static void alsa_lazy(void)
+{
+	snd_pcm_sw_params_t *swp;
+	snd_pcm_uframes_t bufsz, persz;
+	if (snd_pcm_get_params(ahandle, &bufsz, &persz) < 0)
+		return;
+	if (snd_pcm_sw_params_malloc(&swp) < 0)
+		return;
+	if (!snd_pcm_sw_params_current(ahandle, swp) &&
+			!snd_pcm_sw_params_set_avail_min(ahandle, swp, bufsz / 2))
+		snd_pcm_sw_params(ahandle, swp);
+	snd_pcm_sw_params_free(swp);
+}
+
+static int alsa_params(int access)
+{
+	int rate, ch;
+	ffs_ainfo(affs, &rate, &ch);
+	return snd_pcm_set_params(ahandle, SND_PCM_FORMAT_S16, access,
+			ch, rate, 1, a_latency);
+}
+
+/* open and configure the device; alsa_run() starts playing */
+static int alsa_dev(void)
+{
+	snd_pcm_hw_params_t *hwp;
 	int err;
+	if (hs_on)
+		return !a_buf && !(a_buf = malloc(a_size));
 	if ((err = snd_pcm_open(&ahandle, adevice, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
 		printf("Playback open error: %s\n", snd_strerror(err));
 		return 1;
 	}
-	if ((err = snd_pcm_set_params(ahandle,
-					SND_PCM_FORMAT_S16,
-					SND_PCM_ACCESS_RW_INTERLEAVED,
-					2,
-					44100,
-					1,
-					500000)) < 0) {	/* 0.5sec */
+	/* not every device or plugin supports mmap access */
+	if (a_mmap && alsa_params(SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) {
+		printf("fvp: no mmap access on %s; using writei\n", adevice);
+		a_mmap = 0;
+	}
+	if (!a_mmap && (err = alsa_params(SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
 		printf("Playback open error: %s\n", snd_strerror(err));
+		snd_pcm_close(ahandle);
+		ahandle = NULL;
 		return 1;
 	}
-	pthread_create(&a_thread, NULL, process_audio, NULL);
+	if (!a_mmap && !a_buf && !(a_buf = malloc(a_size)))
+		return 1;
+	if (!video && !mosaic)
+		alsa_lazy();
+	if (snd_pcm_hw_params_malloc(&hwp) < 0)
+		return 0;
+	a_canpause = !snd_pcm_hw_params_current(ahandle, hwp) &&
+		snd_pcm_hw_params_can_pause(hwp);
+	snd_pcm_hw_params_free(hwp);
 	return 0;
 }
 
-static void alsa_close(void)
+static int alsa_run(void)
+{
+	if (hs_on)
+		return 0;
+	a_eof = 0;
+	if (rt_thread(&a_thread, a_mmap ? process_mmap : process_audio)) {
+		snd_pcm_close(ahandle);
+		ahandle = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+static int alsa_open(void)
+{
+	return alsa_dev() || alsa_run();
+}
+
+/* stop the audio thread */
+static void alsa_join(void)
 {
 	exited = 1;
+	ev_post(ev_pfd);
 	pthread_join(a_thread, NULL);
-	if (paused) {
-		int err = snd_pcm_drain(ahandle);
-		if (err < 0)
-			printf("snd_pcm_drain failed: %s\n", snd_strerror(err));
+	exited = 0;
+}
+
+static void alsa_close(void)
+{
+	if (!ahandle)
+		return;
+	if (!a_held)
+		alsa_join();
+	snd_pcm_close(ahandle);
+	ahandle = NULL;
+	a_held = 0;
+}
+
+/*
+ * Stop playing without losing the samples in alsa's buffer: pause the
+ * device if it can, otherwise close it and move a_rd back over them.
+ * In mmap mode they are only in alsa's buffer and are dropped.
+ */
+static void alsa_pause(void)
+{
+	snd_pcm_sframes_t delay;
+	if (!ahandle)
+		return;
+	alsa_join();
+	if (a_canpause && !snd_pcm_pause(ahandle, 1)) {
+		a_held = 1;
+		return;
 	}
+	if (!a_mmap && !snd_pcm_delay(ahandle, &delay) && delay > 0)
+		a_advance(&a_rd, -MIN((long) delay * a_fsz, a_size - a_used()));
+	snd_pcm_drop(ahandle);
 	snd_pcm_close(ahandle);
-	exited = 0;
+	ahandle = NULL;
+}
+
+static int alsa_resume(void)
+{
+	if (a_held) {
+		a_held = 0;
+		if (!snd_pcm_pause(ahandle, 0))
+			return alsa_run();
+		snd_pcm_close(ahandle);
+		ahandle = NULL;
+	}
+	return alsa_open();
+}
+
+/* discard the audio decoded or queued in alsa before a seek */
+static void alsa_flush(void)
+{
+	if (a_held)
+		alsa_close();
+	if (ahandle) {
+		alsa_join();
+		snd_pcm_drop(ahandle);
+		snd_pcm_prepare(ahandle);
+	}
+	a_advance(&a_rd, a_used());
+	if (ahandle)
+		alsa_run();
+}
+
+/* the position of the audio being played */
+static long a_pos(void)
+{
+	snd_pcm_sframes_t delay = 0;
+	int rate, ch;
+	ffs_ainfo(affs, &rate, &ch);
+	if (ahandle && snd_pcm_delay(ahandle, &delay) < 0)
+		delay = 0;
+	return ffs_pos(affs) - (long) ((a_used() / a_fsz + delay) * 1000 * speed / rate);
+}
+
+/* the position of the frame or the audio being played */
+static long play_pos(void)
+{
+	return video ? ffs_pos(vffs) : a_pos();
 }
 
 /* subtitle handling */
@@ -204,21 +975,23 @@ static int sub_last;			/* last printed subtitle */
 static void sub_read(void)
 {
 	struct ffs *sffs = ffs_alloc(sub_path, FFS_SUBTS);
+	int n = 0;
 	if (!sffs)
 		return;
-	while (sub_n < SUBSCNT && !ffs_sdec(sffs, &sub_text[sub_n][0], SUBSLEN,
-			&sub_beg[sub_n], &sub_end[sub_n])) {
-		sub_n++;
+	while (n < SUBSCNT && !ffs_sdec(sffs, &sub_text[n][0], SUBSLEN,
+			&sub_beg[n], &sub_end[n])) {
+		n++;
 	}
 	ffs_free(sffs);
+	/* sub_read() runs in parallel with playback */
+	__atomic_store_n(&sub_n, n, __ATOMIC_RELEASE);
 }
 
 static void sub_print(void)
 {
-	struct ffs *ffs = video ? vffs : affs;
 	int l = 0;
-	int h = sub_n;
-	long pos = ffs_pos(ffs);
+	int h = __atomic_load_n(&sub_n, __ATOMIC_ACQUIRE);
+	long pos = play_pos();
 	while (l < h) {
 		int m = (l + h) >> 1;
 		if (pos >= sub_beg[m] && pos <= sub_end[m]) {
@@ -245,47 +1018,184 @@ static void sub_print(void)
 static int cmdread(void)
 {
 	char b;
-	if (read(0, &b, 1) <= 0)
-		return -1;
-	return b;
-}
-
-static void cmdwait(void)
-{
-	struct pollfd ufds[1];
-	ufds[0].fd = 0;
-	ufds[0].events = POLLIN;
-	poll(ufds, 1, -1);
+	int n = read(0, &b, 1);
+	if (n == 0)
+		ev_hangup();
+	return n > 0 ? b : -1;
 }
 
 static void cmdjmp(int n, int rel)
 {
 	struct ffs *ffs = video ? vffs : affs;
-	long pos = (rel ? ffs_pos(ffs) : 0) + n * 1000;
+	long pos = (rel ? play_pos() : 0) + n * 1000;
+	if (live)
+		return;
 	sync_cur = sync_cnt;
+	stepped = 0;
+	vlen = 0;
+	fc_cnt = 0;
 	if (pos < 0)
 		pos = 0;
 	else if (pos >= ffs_duration(ffs))
 		exited = 1;
 	if (!rel)
-		mark['\''] = ffs_pos(ffs);
-	if (audio)
+		mark['\''] = play_pos();
+	if (audio) {
+		pthread_mutex_lock(&a_lock);
 		ffs_seek(affs, ffs, pos);
+		pthread_mutex_unlock(&a_lock);
+		alsa_flush();
+		if (a_eof) {
+			a_eof = 0;
+			ev_post(ev_pfd);
+		}
+	}
 	if (video)
 		ffs_seek(vffs, ffs, pos);
 }
 
+static void cmdpause(void)
+{
+	if (audio && paused) {
+		if (alsa_resume())
+			return;
+	} else if (audio && !paused)
+		alsa_pause();
+	paused = !paused;
+	sync_cur = sync_cnt;
+	reverse = 0;
+	/* continue after the stepped frame, decoding from the key frame before it */
+	if (!paused && stepped) {
+		void *buf;
+		int ret;
+		stepped = 0;
+		vlen = 0;
+		fc_cnt = 0;
+		ffs_seekkey(vffs, vffs, vshown);
+		while ((ret = ffs_vdec(vffs, &buf)) >= 0)
+			if (ret > 0 && ffs_fpos(vffs) >= vshown)
+				break;
+		if (audio) {
+			char tmp[4096];
+			pthread_mutex_lock(&a_lock);
+			ffs_seekkey(affs, vffs, vshown);
+			do
+				ret = ffs_adec(affs, tmp, sizeof(tmp));
+			while (ret >= 0 && ffs_pos(affs) < vshown);
+			pthread_mutex_unlock(&a_lock);
+		}
+	}
+}
+
+/* show the next or the previous frame; return nonzero if there is none */
+static int cmdstep(int dir)
+{
+	int i;
+	if (!video || live)
+		return 1;
+	if (!paused)
+		cmdpause();
+	i = fc_find(vshown);
+	if (dir > 0 && (i < 0 || i + 1 == fc_cnt)) {
+		while (!vlen && (vlen = ffs_vdec(vffs, &vbuf)) == 0)
+			;
+		if (vlen < 0) {
+			vlen = 0;
+			return 1;
+		}
+		if (i < 0)
+			fc_cnt = 0;
+		fc_put(vbuf, vlen, ffs_fpos(vffs));
+		vlen = 0;
+		i = fc_cnt - 1;
+	} else if (dir > 0) {
+		i++;
+	} else if (i > 0) {
+		i--;
+	} else {
+		i = fc_fill(vshown);
+	}
+	if (i < 0)
+		return 1;
+	vshown = fc_pts[i];
+	stepped = 1;
+	draw_frame(fc_buf[i], fc_ll);
+	if (sink)
+		sk_publish(vshown);
+	sub_print();
+	return 0;
+}
+
+static void cmdspeed(float s)
+{
+	if (live)
+		return;
+	speed = MIN(MAX(s, 0.5), 4);
+	if (video)
+		ffs_speed(vffs, speed);
+	if (audio) {
+		pthread_mutex_lock(&a_lock);
+		ffs_speed(affs, speed);
+		pthread_mutex_unlock(&a_lock);
+	}
+	sync_cur = sync_cnt;
+}
+
+/* set zoom and magnify and apply position changes; clear the screen if moved */
+static void cmdgeom(float nzoom, int nmag, int moved)
+{
+	float ozoom = zoom;
+	int w, h;
+	int ow, oh;
+	int i;
+	if (!video)
+		return;
+	ffs_vinfo(vffs, &w, &h);
+	ow = (int) (w * zoom) * magnify;
+	oh = (int) (h * zoom) * magnify;
+	zoom = nzoom;
+	magnify = nmag;
+	if (fullscreen)
+		zoom = zoom_fit();
+	zoom = MIN(MAX(zoom, MAX(8.0 / w, 8.0 / h)), zoom_max);
+	if (moved || (int) (w * zoom) * magnify < ow || (int) (h * zoom) * magnify < oh)
+		draw_clear();
+	ffs_vconf(vffs, zoom, fb_mode());
+	/* cached frames have the old size */
+	if (zoom != ozoom)
+		fc_cnt = 0;
+	/* convert the waiting frame; live sources cannot seek to redraw */
+	if (!paused || live) {
+		if (vlen)
+			vlen = ffs_vconv(vffs, &vbuf);
+		if (vlen && paused)
+			draw_frame(vbuf, vlen);
+		return;
+	}
+	/* redraw the shown frame; decoding it again moves vffs as stepping does */
+	if ((i = fc_find(vshown)) < 0) {
+		i = fc_fill(vshown + 1);
+		stepped = 1;
+	}
+	if (i >= 0) {
+		draw_frame(fc_buf[i], fc_ll);
+		if (sink)
+			sk_publish(vshown);
+	}
+}
+
 static void cmdinfo(void)
 {
 	struct ffs *ffs = video ? vffs : affs;
-	long pos = ffs_pos(ffs);
+	long pos = stepped ? vshown : play_pos();
 	long percent = ffs_duration(ffs) ? pos * 10 / (ffs_duration(ffs) / 100) : 0;
-	printf("\r\33[K%c %3ld.%01ld%%  %3ld:%02ld.%01ld  (AV:%4d)     [%s] \r",
+	printf("\r\33[K%c %3ld.%01ld%%  %3ld:%02ld.%01ld  (%s:%4ld)  %4.2fx  [%s] \r",
 		paused ? (ahandle ? '*' : ' ') : '>',
 		percent / 10, percent % 10,
 		pos / 60000, (pos % 60000) / 1000, (pos % 1000) / 100,
-		video && audio ? ffs_avdiff(vffs, affs) : 0,
-		filename);
+		live ? "LT" : "AV",
+		live ? lv_lat : video && audio ? (long) ffs_avdiff(vffs, affs) : 0,
+		speed, filename);
 	fflush(stdout);
 }
 
@@ -302,7 +1212,7 @@ static void cmdexec(void)
 	while ((c = cmdread()) >= 0) {
 		if (domark) {
 			domark = 0;
-			mark[c] = ffs_pos(video ? vffs : affs);
+			mark[c] = play_pos();
 			continue;
 		}
 		if (dojump) {
@@ -350,13 +1260,18 @@ static void cmdexec(void)
 			break;
 		case ' ':
 		case 'p':
-			if (audio && paused) {
-				if (alsa_open())
-					break;
-			} else if (audio && !paused)
-				alsa_close();
-			paused = !paused;
-			sync_cur = sync_cnt;
+			cmdpause();
+			break;
+		case '.':
+			cmdstep(1);
+			break;
+		case ',':
+			cmdstep(-1);
+			break;
+		case '<':
+			if (!reverse && video && !paused)
+				cmdpause();
+			reverse = !reverse && video;
 			break;
 		case '-':
 			sync_diff = -cmdarg(0);
@@ -373,6 +1288,46 @@ static void cmdexec(void)
 		case 's':
 			sync_cur = cmdarg(sync_cnt);
 			break;
+		case ']':
+			cmdspeed(speed + cmdarg(1) * 0.25);
+			break;
+		case '[':
+			cmdspeed(speed - cmdarg(1) * 0.25);
+			break;
+		case '=':
+			cmdspeed(1);
+			break;
+		case 'z':
+			fullscreen = 0;
+			cmdgeom(zoom * (1 + cmdarg(1) * 0.25), magnify, 0);
+			break;
+		case 'Z':
+			fullscreen = 0;
+			cmdgeom(zoom / (1 + cmdarg(1) * 0.25), magnify, 0);
+			break;
+		case 'f':
+			fullscreen = !fullscreen;
+			cmdgeom(fullscreen ? zoom : zoom_cmd, magnify, 0);
+			break;
+		case 'M':
+			cmdgeom(zoom, cmdarg(1), 0);
+			break;
+		case 'x':
+			posx = cmdarg(0);
+			cmdgeom(zoom, magnify, 1);
+			break;
+		case 'y':
+			posy = cmdarg(0);
+			cmdgeom(zoom, magnify, 1);
+			break;
+		case 'r':
+			rjust = !rjust;
+			cmdgeom(zoom, magnify, 1);
+			break;
+		case 'b':
+			bjust = !bjust;
+			cmdgeom(zoom, magnify, 1);
+			break;
 		case 27:
 			arg = 0;
 			break;
@@ -383,10 +1338,342 @@ static void cmdexec(void)
 	}
 }
 
-/* return nonzero if one more video frame can be decoded */
-static int vsync(void)
+/*
+ * parallel startup: the audio stream and device, the framebuffer and
+ * the subtitles are opened in threads while the main thread probes the
+ * video.  Playback starts as soon as the video is ready; the audio
+ * joins it when st_athread() posts ev_afd.
+ */
+
+static int st_verbose;			/* print startup times */
+static long st_t0;			/* ts_ms() when fvp started */
+static int st_aflags;			/* ffs_alloc() flags of the audio stream */
+static int st_audio;			/* st_athread() was started */
+static int st_adone;			/* st_athread() is done */
+static int st_vknown;			/* the video stream was probed */
+static int st_fret;			/* fb_init() return value */
+static int st_shown;			/* a video frame was drawn */
+static pthread_t st_athr, st_fthr, st_sthr;
+static pthread_mutex_t st_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t st_cond = PTHREAD_COND_INITIALIZER;
+
+static void st_log(char *what, long beg)
+{
+	if (st_verbose)
+		printf("fvp: %-12s %5ldms  at %5ldms\n", what,
+			ts_ms() - beg, ts_ms() - st_t0);
+}
+
+/* the video stream was probed; the audio buffers depend on its presence */
+static void st_video(void)
 {
-	if (!audio)
+	pthread_mutex_lock(&st_lock);
+	st_vknown = 1;
+	pthread_cond_broadcast(&st_cond);
+	pthread_mutex_unlock(&st_lock);
+}
+
+/* set up the audio buffers of affs */
+static int st_ainit(void)
+{
+	/* the audio of a mosaic follows a tile like that of a video */
+	int avsync = video || mosaic;
+	if (!avsync)
+		a_latency = 2000000;
+	if (live)
+		a_latency = 100000;
+	ffs_aconf(affs);
+	/* a deep buffer without video; a nearly full one for A/V sync */
+	return a_init(a_ms ? a_ms : (live ? 100 : avsync ? 200 : 10000),
+			avsync || live ? 15 : 4);
+}
+
+static void *st_athread(void *path)
+{
+	long beg = ts_ms();
+	affs = ffs_alloc(path, st_aflags);
+	st_log("audio probe", beg);
+	pthread_mutex_lock(&st_lock);
+	while (!st_vknown)
+		pthread_cond_wait(&st_cond, &st_lock);
+	pthread_mutex_unlock(&st_lock);
+	if (affs) {
+		beg = ts_ms();
+		if (st_ainit()) {
+			ffs_free(affs);
+			affs = NULL;
+		} else {
+			alsa_dev();
+		}
+		st_log("audio device", beg);
+	}
+	__atomic_store_n(&st_adone, 1, __ATOMIC_RELEASE);
+	ev_post(ev_afd);
+	return NULL;
+}
+
+static void *st_fthread(void *dev)
+{
+	long beg = ts_ms();
+	st_fret = fb_init(dev);
+	st_log("framebuffer", beg);
+	return NULL;
+}
+
+static void *st_sthread(void *dat)
+{
+	long beg = ts_ms();
+	sub_read();
+	st_log("subtitles", beg);
+	return NULL;
+}
+
+/* start playing the audio opened by st_athread() */
+static void st_ajoin(void)
+{
+	pthread_join(st_athr, NULL);
+	st_audio = 0;
+	if (!affs)
+		return;
+	audio = 1;
+	if (video && ffs_pos(vffs) > 0)
+		ffs_seek(affs, vffs, ffs_pos(vffs));
+	if (speed != 1)
+		ffs_speed(affs, speed);
+	sync_cur = sync_cnt;
+	/* cmdpause() opens the device again */
+	if (paused && ahandle) {
+		snd_pcm_close(ahandle);
+		ahandle = NULL;
+	}
+	if (!paused && ahandle)
+		alsa_run();
+	st_log("audio", st_t0);
+}
+
+/*
+ * test harness: with -H, fvp plays on a virtual clock with a fake
+ * framebuffer and a null audio device, as fast as it can decode.  The
+ * clock advances only when the main loop waits.  The audio device
+ * plays a_latency worth of samples at the sample rate; beeps are
+ * timestamped when played and white flashes when drawn.  The harness
+ * seeks every HS_SEEK milliseconds and prints the A-V error, jitter,
+ * dropped frames and seek latency, failing if a budget is exceeded.
+ */
+
+#define HS_STEP		5		/* virtual clock step in milliseconds */
+#define HS_SEEK		15000		/* milliseconds between seeks */
+#define HS_SETTLE	1500		/* ignore A-V errors this long after a seek */
+#define HS_EVENTS	4096		/* recorded flashes and beeps */
+
+static long hs_budget[4] = {-1, -1, -1, -1};	/* av, jitter, drops, seek */
+static int hs_rate;			/* audio sample rate */
+static long hs_cap;			/* null device buffer in frames */
+static double hs_dev;			/* frames in the null device */
+static long hs_quiet;			/* frames since the last loud sample */
+static long hs_beep[HS_EVENTS];		/* when the beeps were played */
+static long hs_flash[HS_EVENTS];	/* when the flashes were drawn */
+static int hs_nbeep, hs_nflash;
+static int hs_lit;			/* the last frame was a flash */
+static long hs_lastt = -1, hs_lastp;	/* time and pts of the last frame */
+static long hs_fdur;			/* the shortest frame interval */
+static int hs_frames, hs_drops;
+static double hs_jit;			/* sum of squared interval errors */
+static int hs_jcnt;
+static double hs_avsum;			/* sum of per-frame A-V errors */
+static long hs_avmax;
+static int hs_avcnt;
+static long hs_next;			/* time of the next seek */
+static long hs_seekt = -1;		/* time of the pending seek */
+static long hs_seekw;			/* wall-clock time of the pending seek */
+static long hs_seekmax, hs_seekwmax;
+static int hs_seeks;
+static long hs_settle;			/* ignore A-V errors before this */
+static long hs_fired;			/* ev_due that has fired, like timerfd */
+
+static long hs_wall(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* parse "av=ms,jitter=ms,drops=n,seek=ms" budgets */
+static void hs_init(char *spec)
+{
+	char *keys[] = {"av=", "jitter=", "drops=", "seek="};
+	int i;
+	hs_on = 1;
+	while (spec && *spec) {
+		for (i = 0; i < 4; i++)
+			if (!strncmp(spec, keys[i], strlen(keys[i])))
+				hs_budget[i] = atol(spec + strlen(keys[i]));
+		spec = strchr(spec, ',') ? strchr(spec, ',') + 1 : NULL;
+	}
+}
+
+/* move the ring buffer into the null device; the time is now */
+static int hs_play(long now)
+{
+	long room, len;
+	int moved = 0;
+	if (!hs_rate) {
+		int ch;
+		ffs_ainfo(affs, &hs_rate, &ch);
+		hs_cap = (long long) a_latency * hs_rate / 1000000;
+	}
+	room = hs_cap - (long) hs_dev;
+	while (room > 0 && (len = MIN(a_used(), a_size - (long) (a_rd % a_size))) > 0) {
+		short *smp = (void *) (a_buf + a_rd % a_size);
+		long n = MIN(len / a_fsz, room);
+		long i;
+		for (i = 0; i < n; i++, smp += a_fsz / 2) {
+			if (abs(*smp) < 8000) {
+				hs_quiet++;
+				continue;
+			}
+			if (hs_quiet > hs_rate / 5 && hs_nbeep < HS_EVENTS)
+				hs_beep[hs_nbeep++] = now + (hs_dev + i) * 1000 / hs_rate;
+			hs_quiet = 0;
+		}
+		a_advance(&a_rd, n * a_fsz);
+		hs_dev += n;
+		room -= n;
+		moved = 1;
+	}
+	return moved;
+}
+
+/* ev_wait() on the virtual clock */
+static int hs_wait(int timeout)
+{
+	long now = ts_ms();
+	long next = now + HS_STEP;
+	int ret = 0;
+	int armed = ev_due && ev_due != hs_fired;
+	if (!timeout)
+		return 0;
+	if (armed && ev_due <= now) {
+		hs_fired = ev_due;
+		return EV_TIMER;
+	}
+	if (armed && ev_due < next)
+		next = ev_due;
+	ts_fake = next;
+	if (audio) {
+		hs_dev = MAX(0, hs_dev - (double) (next - now) * hs_rate / 1000);
+		if (hs_play(next))
+			ret |= EV_AUDIO;
+	}
+	if (armed && ev_due <= next) {
+		hs_fired = ev_due;
+		ret |= EV_TIMER;
+	}
+	if (next >= hs_next && hs_seekt < 0 && !paused) {
+		cmdjmp(5, 1);
+		hs_seekt = next;
+		hs_seekw = hs_wall();
+		hs_settle = next + HS_SETTLE;
+		hs_next = next + HS_SEEK;
+	}
+	return ret;
+}
+
+/* record a frame drawn from img */
+static void hs_frame(char *img, int linelen, long pts)
+{
+	long now = ts_ms();
+	int w, h, lit;
+	char *px;
+	if (hs_seekt >= 0) {
+		hs_seekmax = MAX(hs_seekmax, now - hs_seekt);
+		hs_seekwmax = MAX(hs_seekwmax, hs_wall() - hs_seekw);
+		hs_seeks++;
+		hs_seekt = -1;
+		hs_lastt = -1;
+	}
+	if (hs_lastt >= 0) {
+		long dp = pts - hs_lastp;
+		double err = (now - hs_lastt) - dp / speed;
+		if (dp > 0 && (!hs_fdur || dp < hs_fdur))
+			hs_fdur = dp;
+		if (hs_fdur && dp > hs_fdur * 3 / 2)
+			hs_drops += (dp + hs_fdur / 2) / hs_fdur - 1;
+		hs_jit += err * err;
+		hs_jcnt++;
+	}
+	hs_lastt = now;
+	hs_lastp = pts;
+	hs_frames++;
+	/* the audio being played; within one audio packet */
+	if (audio && hs_rate && now >= hs_settle) {
+		long apos = ffs_pos(affs) - (a_used() / a_fsz + hs_dev) * 1000 * speed / hs_rate;
+		long av = pts - apos;
+		hs_avsum += labs(av);
+		hs_avmax = MAX(hs_avmax, labs(av));
+		hs_avcnt++;
+		if (st_verbose)
+			printf("harness: frame %7ld  at %7ld  A-V %5ld\n", pts, now, av);
+	}
+	ffs_vinfo(vffs, &w, &h);
+	px = img + (int) (h * zoom / 2) * linelen + (int) (w * zoom / 2) * FBM_BPP(fb_mode());
+	lit = (unsigned char) px[0] + (unsigned char) px[1] + (unsigned char) px[2] > 600;
+	if (lit && !hs_lit && now >= hs_settle && hs_nflash < HS_EVENTS)
+		hs_flash[hs_nflash++] = now;
+	hs_lit = lit;
+}
+
+static int hs_check(char *name, long val, int idx)
+{
+	int bad = hs_budget[idx] >= 0 && val > hs_budget[idx];
+	if (hs_budget[idx] >= 0)
+		printf("harness: %-7s %6ld  budget %6ld  %s\n", name, val,
+			hs_budget[idx], bad ? "FAIL" : "ok");
+	return bad;
+}
+
+/* print the results; return nonzero if a budget is exceeded */
+static int hs_report(void)
+{
+	long fsum = 0, fmax = 0;
+	int fcnt = 0;
+	int i, j;
+	long jitter = hs_jcnt ? (long) sqrt(hs_jit / hs_jcnt) : 0;
+	long av;
+	/* match each flash with the nearest beep */
+	for (i = 0, j = 0; i < hs_nflash && hs_nbeep; i++) {
+		long d;
+		while (j + 1 < hs_nbeep && labs(hs_beep[j + 1] - hs_flash[i]) <=
+				labs(hs_beep[j] - hs_flash[i]))
+			j++;
+		if ((d = labs(hs_flash[i] - hs_beep[j])) < 500) {
+			fsum += d;
+			fmax = MAX(fmax, d);
+			fcnt++;
+		}
+	}
+	printf("\nharness: %d frames, %d dropped, %ldms jitter\n",
+		hs_frames, hs_drops, jitter);
+	printf("harness: pts A-V error %ldms mean, %ldms max\n",
+		hs_avcnt ? (long) (hs_avsum / hs_avcnt) : 0, hs_avmax);
+	printf("harness: %d flashes and %d beeps; A-V error %ldms mean, %ldms max\n",
+		hs_nflash, hs_nbeep, fcnt ? fsum / fcnt : 0, fmax);
+	printf("harness: %d seeks; %ldms max latency (%ldms wall-clock)\n",
+		hs_seeks, hs_seekmax, hs_seekwmax);
+	/* the flashes are the measured error; timestamps otherwise */
+	av = fcnt ? fmax : hs_avmax;
+	return hs_check("av", av, 0) | hs_check("jitter", jitter, 1) |
+		hs_check("drops", hs_drops, 2) | hs_check("seek", hs_seekmax, 3);
+}
+
+/* return nonzero if one more video frame can be decoded; due is its deadline */
+#define SYNC_RETRY	10		/* check a frame ahead of the audio again (ms) */
+
+static int vsync(long *due)
+{
+	*due = 0;
+	/* nothing to follow after the audio ends or without a device */
+	if (!audio || a_eof || (!ahandle && !hs_on))
 		goto ts_chk;
 	if (sync_period && sync_since++ >= sync_period) {
 		sync_cur = sync_cnt;
@@ -401,44 +1688,129 @@ static int vsync(void)
 	}
 	if (sync_cur > 0) {
 		sync_cur--;
-		return ffs_avdiff(vffs, affs) >= sync_diff;
+		if (ffs_avdiff(vffs, affs) >= sync_diff)
+			return 1;
+		/* the audio may never wake the loop again */
+		*due = ts_ms() + SYNC_RETRY;
+		return 0;
 	}
 	ts_chk:
-	ffs_wait(vffs);
+	*due = ffs_wait(vffs);
 	return 1;
 }
 
+/*
+ * The main loop sleeps in ev_wait() until a key is pressed, the audio
+ * thread consumes a buffer, or the decoded video frame becomes due.
+ */
 static void mainloop(void)
 {
 	int ret = 0;
 	while (ret >= 0) {
+		int idle = 1;
 		cmdexec();
 		if (exited)
 			return;
+		if (st_audio && __atomic_load_n(&st_adone, __ATOMIC_ACQUIRE))
+			st_ajoin();
 		if (paused) {
-			cmdwait();
+			if (reverse && ts_ms() >= vdue) {
+				long pos = vshown;
+				reverse = !cmdstep(-1);
+				/* at half speed */
+				vdue = ts_ms() + 2 * MIN(MAX(pos - vshown, 20), 100);
+			}
+			ev_timer(reverse ? vdue : 0);
+			ev_wait(-1);
 			continue;
 		}
-		while (audio && !a_prodwait()) {
-			ret = ffs_adec(affs, a_buf[a_prod], ABUFLEN);
-			if (ret > 0) {
-				a_len[a_prod] = ret;
-				a_prod = (a_prod + 1) & (ABUFCNT - 1);
-			} else
-				break;
-		}
-		if (video && vsync()) {
+		if (audio)
+			a_fill();
+		if (video && live && !vlen) {
+			/* decode but do not show frames until the latency drops */
+			ffs_skip(vffs, lv_lat > 4 * live);
+			ret = ffs_vdec(vffs, lv_lat > live ? NULL : &vbuf);
+			if (ret >= 0)
+				lv_update(ffs_fpos(vffs));
+			if (ret > 0)
+				vlen = ret;
+			idle = 0;
+		} else if (video && !vlen && ts_ms() >= vdue && vsync(&vdue)) {
 			int ignore = jump && (vnum % (jump + 1));
-			void *buf;
-			ret = ffs_vdec(vffs, ignore ? NULL : &buf);
+			ret = ffs_vdec(vffs, ignore ? NULL : &vbuf);
 			vnum++;
-			if (ret > 0) {
-				draw_frame((void *) buf, ret);
-				sub_print();
+			if (ret > 0)
+				vlen = ret;
+			idle = 0;
+		}
+		if (vlen && (live || ts_ms() >= vdue)) {
+			vshown = ffs_fpos(vffs);
+			draw_frame(vbuf, vlen);
+			if (!st_shown++)
+				st_log("first frame", st_t0);
+			if (hs_on)
+				hs_frame(vbuf, vlen, vshown);
+			if (sink)
+				sk_publish(vshown);
+			if (live)
+				lv_update(vshown);
+			sub_print();
+			vlen = 0;
+			idle = 0;
+		}
+		ev_timer(vdue);
+		ev_wait(idle ? -1 : 0);
+	}
+	/* play the audio already decoded */
+	while (audio && (ahandle || hs_on) && !exited && !paused && !a_mmap && !a_conswait()) {
+		cmdexec();
+		ev_wait(-1);
+	}
+	if (audio && !exited && !paused && ahandle && !a_mmap)
+		snd_pcm_drain(ahandle);
+}
+
+/*
+ * Audio-only playback: a_buf is filled with many packets at once and
+ * the loop sleeps until the audio thread has played most of it.
+ */
+static void aloop(void)
+{
+	while (1) {
+		cmdexec();
+		if (exited)
+			return;
+		if (!paused)
+			a_fill();
+		if (a_eof && (a_mmap || a_conswait()))
+			break;
+		ev_wait(-1);
+	}
+	if (!paused)
+		snd_pcm_drain(ahandle);
+}
+
+/* mosaic playback: ms_worker() threads play the tiles and this the audio */
+static void mosaicloop(void)
+{
+	int c;
+	while (ms_playing()) {
+		while ((c = cmdread()) >= 0) {
+			if (c == 'q')
+				exited = 1;
+			if (c == ' ' || c == 'p') {
+				cmdpause();
+				ms_pause(paused);
 			}
-			continue;
 		}
-		stroll();
+		if (exited)
+			return;
+		if (audio && !paused)
+			a_fill();
+		/* let the audio tile play on after the audio ends */
+		if (audio && a_eof)
+			ms_sync(mosaic - 2, NULL);
+		ev_wait(-1);
 	}
 }
 
@@ -452,13 +1824,29 @@ static char *usage = "usage: fbff [options] file\n"
 	"  -a n     select audio stream; '-' disables audio\n"
 	"  -s       always synchronize (-sx for every x frames)\n"
 	"  -u       record A/V delay after the first few frames\n"
+	"  -n       live source; show frames as they arrive (-nx for x ms latency)\n"
+	"  -l ms    audio buffer length in milliseconds\n"
+	"  -M       decode audio directly into alsa's mmap buffer\n"
+	"  -S x     playback speed (0.5 to 4)\n"
+	"  -C mb    memory limit of the frame cache for stepping\n"
+	"  -T CxR   write CxR contact sheets of the given files (-T CxR:width)\n"
+	"  -o path  contact sheet path; %s is the file name (%s.ppm or %s.png)\n"
+	"  -W n     tile the given files on the screen; audio from the n-th\n"
 	"  -t path  subtitles file\n"
 	"  -x n     horizontal video position\n"
 	"  -y n     vertical video position\n"
 	"  -r       adjust the video to the right of the screen\n"
-	"  -b       adjust the video to the bottom of the screen\n\n";
+	"  -b       adjust the video to the bottom of the screen\n"
+	"  -R n     rotate the video clockwise by 90, 180 or 270 degrees\n"
+	"  -k name  draw into shared memory name (-k name:WxH:bpp:slots)\n"
+	"  -F prio  run the audio thread with SCHED_FIFO priority prio\n"
+	"  -c cpus  pin audio (and decoding) threads to cpus: 0,1[:2-3]\n"
+	"  -L       lock memory and prefault buffers\n"
+	"  -V       print startup times\n"
+	"  -H spec  test a/v sync with budgets: av=ms,jitter=ms,drops=n,seek=ms\n\n";
 
-static void read_args(int argc, char *argv[])
+/* return the index of the first file */
+static int read_args(int argc, char *argv[])
 {
 	int i = 1;
 	while (i < argc) {
@@ -478,7 +1866,7 @@ static void read_args(int argc, char *argv[])
 		if (c[1] == 't')
 			sub_path = c[2] ? c + 2 : argv[++i];
 		if (c[1] == 'h')
-			printf(usage);
+			fputs(usage, stdout);
 		if (c[1] == 'x')
 			posx = c[2] ? atoi(c + 2) : atoi(argv[++i]);
 		if (c[1] == 'y')
@@ -489,6 +1877,44 @@ static void read_args(int argc, char *argv[])
 			bjust = 1;
 		if (c[1] == 'u')
 			sync_first = 32;
+		if (c[1] == 'n')
+			live = c[2] ? atoi(c + 2) : 100;
+		if (c[1] == 'S')
+			speed = c[2] ? atof(c + 2) : atof(argv[++i]);
+		if (c[1] == 'T') {
+			char *arg = c[2] ? c + 2 : argv[++i];
+			sscanf(arg, "%dx%d:%d", &th_cols, &th_rows, &th_width);
+		}
+		if (c[1] == 'W')
+			mosaic = (c[2] ? atoi(c + 2) : atoi(argv[++i])) + 1;
+		if (c[1] == 'o')
+			th_out = c[2] ? c + 2 : argv[++i];
+		if (c[1] == 'R') {
+			rotate = c[2] ? atoi(c + 2) : atoi(argv[++i]);
+			if (rotate != 90 && rotate != 180 && rotate != 270)
+				rotate = 0;
+		}
+		if (c[1] == 'C')
+			fc_mb = c[2] ? atoi(c + 2) : atoi(argv[++i]);
+		if (c[1] == 'F')
+			rt_prio = c[2] ? atoi(c + 2) : atoi(argv[++i]);
+		if (c[1] == 'c') {
+			char *arg = rt_cpus(c[2] ? c + 2 : argv[++i], &rt_acpu);
+			if (*arg == ':')
+				rt_cpus(arg + 1, &rt_vcpu);
+		}
+		if (c[1] == 'L')
+			rt_lock = 1;
+		if (c[1] == 'V')
+			st_verbose = 1;
+		if (c[1] == 'H')
+			hs_init(c[2] ? c + 2 : argv[++i]);
+		if (c[1] == 'k')
+			sink = c[2] ? c + 2 : argv[++i];
+		if (c[1] == 'M')
+			a_mmap = 1;
+		if (c[1] == 'l')
+			a_ms = c[2] ? atoi(c + 2) : atoi(argv[++i]);
 		if (c[1] == 'v') {
 			char *arg = c[2] ? c + 2 : argv[++i];
 			video = arg[0] == '-' ? 0 : atoi(arg) + 2;
@@ -499,6 +1925,7 @@ static void read_args(int argc, char *argv[])
 		}
 		i++;
 	}
+	return i;
 }
 
 static void term_init(struct termios *termios)
@@ -526,6 +1953,8 @@ static void signalreceived(int n)
 			exit(1);
 		exited++;
 		retcode = n + 128;
+		/* do not wait for a stalled live source */
+		ffs_abort();
 	}
 }
 
@@ -533,51 +1962,155 @@ int main(int argc, char *argv[])
 {
 	struct termios termios;
 	char *path = argv[argc - 1];
+	int files;
+	int athr, fthr = 0;
 	if (argc < 2) {
 		printf("usage: %s [-u -s60 ...] file\n", argv[0]);
 		return 1;
 	}
-	read_args(argc, argv);
+	files = read_args(argc, argv);
+	/* threads created later, like mosaic workers, inherit these cpus */
+	if (CPU_COUNT(&rt_vcpu) && pthread_setaffinity_np(pthread_self(), sizeof(rt_vcpu), &rt_vcpu))
+		printf("fvp: cannot pin the decoding thread\n");
 	ffs_globinit();
+	if (th_cols > 0 && th_rows > 0)
+		return th_main(argv + files, argc - files);
+	if (ev_init())
+		return 1;
 	snprintf(filename, sizeof(filename), "%s", path);
-	if (video && !(vffs = ffs_alloc(path, FFS_VIDEO | (video - 1))))
+	if (hs_on) {
+		ts_fake = 1000;
+		hs_next = ts_fake + HS_SEEK;
+		a_mmap = 0;
+		live = 0;
+		mosaic = 0;
+	}
+	st_t0 = ts_ms();
+	if (mosaic) {
 		video = 0;
-	if (audio && !(affs = ffs_alloc(path, FFS_AUDIO | (audio - 1))))
+		if (mosaic - 1 > argc - files || mosaic == 1)
+			audio = 0;
+		else
+			path = argv[files + mosaic - 2];
+	}
+	if (sub_path)
+		pthread_create(&st_sthr, NULL, st_sthread, NULL);
+	if (video && !sink && !hs_on)
+		fthr = !pthread_create(&st_fthr, NULL, st_fthread, getenv("FBDEV"));
+	/* live audio is demuxed by vffs */
+	athr = audio && !(live && video) && !mosaic;
+	if (athr) {
+		st_aflags = FFS_AUDIO | (audio - 1) | (live ? FFS_LIVE : 0);
+		st_audio = !pthread_create(&st_athr, NULL, st_athread, path);
 		audio = 0;
-	if (!video && !audio)
+	}
+	if (video) {
+		long beg = ts_ms();
+		if (!(vffs = ffs_alloc(path, FFS_VIDEO | (video - 1) | (live ? FFS_LIVE : 0))))
+			video = 0;
+		st_log("video probe", beg);
+	}
+	st_video();
+	/* without video, there is nothing to do until the audio is ready */
+	if (st_audio && (!video || hs_on))
+		st_ajoin();
+	if (audio && !athr) {
+		/* live sources, like pipes, cannot be opened twice */
+		if (!(affs = live && video ?
+				ffs_peer(vffs, FFS_AUDIO | FFS_LIVE | (audio - 1)) :
+				ffs_alloc(path, FFS_AUDIO | (audio - 1) | (live ? FFS_LIVE : 0))))
+			audio = 0;
+		/* the audio thread cannot decode the packets queued by vffs */
+		if (live && video)
+			a_mmap = 0;
+		if (audio && st_ainit())
+			return 1;
+		if (audio)
+			alsa_open();
+	}
+	if (fthr) {
+		pthread_join(st_fthr, NULL);
+		if (video && st_fret)
+			return 1;
+		if (!video && !st_fret)
+			fb_free();
+	}
+	if (!video && !audio && !mosaic)
+		return 1;
+	if (hs_on && !video) {
+		printf("fvp: -H needs a video stream\n");
 		return 1;
-	if (sub_path)
-		sub_read();
-	if (audio) {
-		ffs_aconf(affs);
-		alsa_open();
 	}
 	if (video) {
 		int w, h;
-		if (fb_init(getenv("FBDEV")))
-			return 1;
 		ffs_vinfo(vffs, &w, &h);
-		if (fullscreen) {
-			float hz = (float) fb_rows() / h / magnify;
-			float wz = (float) fb_cols() / w / magnify;
-			zoom = hz < wz ? hz : wz;
+		if (rotate % 180) {
+			int t = w;
+			w = h;
+			h = t;
 		}
+		if (sink && sk_init(sink, w * zoom * magnify, h * zoom * magnify))
+			return 1;
+		if (hs_on && !sink && sk_fake(w * zoom * magnify, h * zoom * magnify))
+			return 1;
+		zoom_cmd = zoom;
+		if (fullscreen)
+			zoom = zoom_fit();
+		/* allocate the buffer for the largest zoom the keys may choose */
+		zoom_max = MAX(MAX(zoom, zoom_cmd), zoom_fit() * magnify);
+		ffs_vconf(vffs, zoom_max, fb_mode());
 		ffs_vconf(vffs, zoom, fb_mode());
 	}
+	if (mosaic) {
+		if (fb_init(getenv("FBDEV")))
+			return 1;
+		if (!ms_open(argv + files, argc - files, ev_afd))
+			return 1;
+		if (audio)
+			ms_sync(mosaic - 2, affs);
+		ms_start();
+	}
+	if (speed != 1)
+		cmdspeed(speed);
+	/* a_buf and alsa's buffers are locked only if allocated by now */
+	if (rt_lock && st_audio)
+		st_ajoin();
+	if (rt_lock)
+		rt_mlock();
 	term_init(&termios);
 	signal(SIGINT, signalreceived);
 	signal(SIGTERM, signalreceived);
-	mainloop();
-	if (video) {
+	if (mosaic)
+		mosaicloop();
+	else if (video)
+		mainloop();
+	else
+		aloop();
+	if (st_audio)
+		st_ajoin();
+	if (sub_path)
+		pthread_join(st_sthr, NULL);
+	if (hs_on && hs_report())
+		retcode = 1;
+	if (mosaic) {
+		ms_close();
 		fb_free();
+	}
+	if (video) {
+		if (sink)
+			sk_free();
+		else
+			fb_free();
+		fc_free();
 		ffs_free(vffs);
 	}
 	if (audio) {
-		if (!paused)
-			alsa_close();
+		alsa_close();
 		ffs_free(affs);
+		free(a_buf);
 	}
 	term_done(&termios);
+	ev_free();
 	printf("\n");
 	return retcode;
 }
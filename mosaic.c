@@ -0,0 +1,181 @@
+/* several video streams tiled on the framebuffer */
+
+#define MS_MAX		16	/* maximum number of tiles */
+#define MS_LATE		40	/* skip non-reference frames when this late (ms) */
+#define MS_WAIT		10	/* retry period of a tile ahead of the audio (ms) */
+
+struct tile {
+	struct ffs *ffs;
+	int x, y;		/* screen position */
+	int w, h;		/* scaled video size */
+	long due;		/* when to decode the next frame */
+	int busy;		/* a worker is decoding this tile */
+	int done;		/* end of stream */
+	struct ffs *sync;	/* the audio stream this tile follows */
+};
+
+static struct tile ms_tiles[MS_MAX];
+static int ms_cnt;			/* number of tiles */
+static int ms_left;			/* tiles still playing */
+static int ms_quit;			/* stop the workers */
+static int ms_paused;			/* do not decode */
+static int ms_efd = -1;			/* eventfd posted when a tile ends */
+static pthread_t ms_thr[MS_MAX];	/* worker threads */
+static int ms_thrcnt;			/* number of workers */
+static pthread_mutex_t ms_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ms_cond;
+
+/* decode one packet of the tile and draw the resulting frame */
+static void ms_play(struct tile *t)
+{
+	int bpp = FBM_BPP(fb_mode());
+	void *buf;
+	int ret, r;
+	struct ffs *sync = __atomic_load_n(&t->sync, __ATOMIC_ACQUIRE);
+	int late = ts_ms() - t->due > MS_LATE;
+	/* wait for the audio when ahead of it and catch up when behind */
+	if (sync) {
+		int diff = ffs_avdiff(t->ffs, sync);
+		if (diff < 0) {
+			t->due = ts_ms() + MS_WAIT;
+			return;
+		}
+		late = diff > MS_LATE;
+	}
+	/* behind schedule: degrade this tile rather than the whole wall */
+	ffs_skip(t->ffs, late);
+	t->due = sync ? ts_ms() : ffs_wait(t->ffs);
+	if ((ret = ffs_vdec(t->ffs, &buf)) < 0) {
+		t->done = 1;
+		return;
+	}
+	for (r = 0; ret > 0 && r < t->h; r++)
+		memcpy(fb_mem(t->y + r) + t->x * bpp, (char *) buf + r * ret, t->w * bpp);
+}
+
+/* the tile that is due first, or NULL */
+static struct tile *ms_next(void)
+{
+	struct tile *t = NULL;
+	int i;
+	for (i = 0; i < ms_cnt; i++) {
+		struct tile *c = &ms_tiles[i];
+		if (c->ffs && !c->busy && !c->done && (!t || c->due < t->due))
+			t = c;
+	}
+	return t;
+}
+
+static void *ms_worker(void *dat)
+{
+	pthread_mutex_lock(&ms_lock);
+	while (!ms_quit) {
+		struct tile *t = ms_paused ? NULL : ms_next();
+		struct timespec ts;
+		uint64_t n = 1;
+		if (!t) {
+			pthread_cond_wait(&ms_cond, &ms_lock);
+			continue;
+		}
+		if (t->due > ts_ms()) {
+			ts.tv_sec = t->due / 1000;
+			ts.tv_nsec = (t->due % 1000) * 1000000;
+			pthread_cond_timedwait(&ms_cond, &ms_lock, &ts);
+			continue;
+		}
+		t->busy = 1;
+		pthread_mutex_unlock(&ms_lock);
+		ms_play(t);
+		pthread_mutex_lock(&ms_lock);
+		t->busy = 0;
+		if (t->done && !--ms_left && write(ms_efd, &n, sizeof(n)) < 0)
+			perror("ms_worker()");
+		pthread_cond_broadcast(&ms_cond);
+	}
+	pthread_mutex_unlock(&ms_lock);
+	return NULL;
+}
+
+/* open the streams and assign each a screen tile; efd is posted at the end */
+static int ms_open(char **paths, int n, int efd)
+{
+	int cols = 1, rows;
+	int cw, ch;
+	int i;
+	ms_cnt = MIN(n, MS_MAX);
+	ms_efd = efd;
+	while (cols * cols < ms_cnt)
+		cols++;
+	rows = (ms_cnt + cols - 1) / cols;
+	cw = fb_cols() / cols;
+	ch = fb_rows() / rows;
+	for (i = 0; i < fb_rows(); i++)
+		memset(fb_mem(i), 0, fb_cols() * FBM_BPP(fb_mode()));
+	for (i = 0; i < ms_cnt; i++) {
+		struct tile *t = &ms_tiles[i];
+		float zoom;
+		int w, h;
+		if (!(t->ffs = ffs_alloc(paths[i], FFS_VIDEO))) {
+			fprintf(stderr, "fvp: %s: cannot open\n", paths[i]);
+			continue;
+		}
+		ffs_vinfo(t->ffs, &w, &h);
+		zoom = MIN((float) cw / w, (float) ch / h);
+		t->w = w * zoom;
+		t->h = h * zoom;
+		t->x = (i % cols) * cw + (cw - t->w) / 2;
+		t->y = (i / cols) * ch + (ch - t->h) / 2;
+		ffs_vconf(t->ffs, zoom, fb_mode());
+		ms_left++;
+	}
+	return ms_left;
+}
+
+/* start a worker per processor, at most one per tile */
+static void ms_start(void)
+{
+	pthread_condattr_t attr;
+	int n = MIN(sysconf(_SC_NPROCESSORS_ONLN), ms_cnt);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ms_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	for (ms_thrcnt = 0; ms_thrcnt < MAX(n, 1); ms_thrcnt++)
+		if (pthread_create(&ms_thr[ms_thrcnt], NULL, ms_worker, NULL))
+			break;
+}
+
+/* make tile i follow the audio decoded from affs; NULL stops following */
+static void ms_sync(int i, struct ffs *affs)
+{
+	if (i < ms_cnt && ms_tiles[i].ffs)
+		__atomic_store_n(&ms_tiles[i].sync, affs, __ATOMIC_RELEASE);
+}
+
+static void ms_pause(int paused)
+{
+	pthread_mutex_lock(&ms_lock);
+	ms_paused = paused;
+	pthread_cond_broadcast(&ms_cond);
+	pthread_mutex_unlock(&ms_lock);
+}
+
+static int ms_playing(void)
+{
+	return ms_left > 0;
+}
+
+static void ms_close(void)
+{
+	int i;
+	pthread_mutex_lock(&ms_lock);
+	ms_quit = 1;
+	pthread_cond_broadcast(&ms_cond);
+	pthread_mutex_unlock(&ms_lock);
+	for (i = 0; i < ms_thrcnt; i++)
+		pthread_join(ms_thr[i], NULL);
+	pthread_cond_destroy(&ms_cond);
+	for (i = 0; i < ms_cnt; i++)
+		if (ms_tiles[i].ffs)
+			ffs_free(ms_tiles[i].ffs);
+}
@@ -0,0 +1,178 @@
+/*
+ * shared memory output: frames are drawn into a ring of slots in a
+ * POSIX shared memory object instead of the framebuffer.  The layout,
+ * in host byte order, is a struct sk_head followed by slots slots,
+ * each a struct sk_slot followed by height rows of linelen bytes.
+ *
+ * After drawing a frame, fvp stores its sequence number in the slot,
+ * points last to it and increments seq, waking the futex on seq.  A
+ * slot's seq is zero while it is being drawn; readers should compare
+ * it before and after copying a slot to detect overwritten frames.
+ */
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define SK_MAGIC	"fvpshm1"
+#define SK_SLOTS	3		/* default number of slots */
+
+struct sk_head {
+	char magic[8];		/* SK_MAGIC */
+	uint32_t slots;		/* number of slots */
+	uint32_t width;		/* frame width in pixels */
+	uint32_t height;	/* frame height in pixels */
+	uint32_t linelen;	/* bytes per row */
+	uint32_t mode;		/* pixel format as returned by fb_mode() */
+	uint32_t slotoff;	/* offset of the first slot */
+	uint32_t slotlen;	/* bytes per slot, including struct sk_slot */
+	uint32_t seq;		/* number of published frames; a futex */
+	uint32_t last;		/* the slot of the last published frame */
+	uint32_t pad;
+};
+
+struct sk_slot {
+	uint32_t seq;		/* the value of seq after publishing this frame */
+	uint32_t pad;
+	int64_t pts;		/* frame timestamp in milliseconds */
+};
+
+static char sk_name[64];		/* shared memory object name; empty if unused */
+static struct sk_head *sk_head;		/* mmap()ed shared memory */
+static long sk_len;			/* sk_head mapping length */
+static int sk_cur;			/* the slot being drawn */
+
+static struct sk_slot *sk_slot(int i)
+{
+	return (void *) ((char *) sk_head + sk_head->slotoff + (long) i * sk_head->slotlen);
+}
+
+/* make draw.c draw into slot i */
+static void sk_use(int i)
+{
+	sk_cur = i;
+	__atomic_store_n(&sk_slot(i)->seq, 0, __ATOMIC_RELAXED);
+	/* readers must see seq cleared before any of the new pixels */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	fb = (char *) sk_slot(i) + sizeof(struct sk_slot);
+}
+
+/* set up draw.c as a framebuffer of the given geometry and bytes per pixel */
+static void sk_fbinfo(int w, int h, int depth)
+{
+	memset(&vinfo, 0, sizeof(vinfo));
+	memset(&finfo, 0, sizeof(finfo));
+	vinfo.xres = vinfo.xres_virtual = w;
+	vinfo.yres = vinfo.yres_virtual = h;
+	vinfo.bits_per_pixel = depth * 8;
+	if (depth == 2) {
+		vinfo.red.offset = 11;
+		vinfo.red.length = 5;
+		vinfo.green.offset = 5;
+		vinfo.green.length = 6;
+		vinfo.blue.length = 5;
+	} else {
+		vinfo.red.offset = 16;
+		vinfo.red.length = 8;
+		vinfo.green.offset = 8;
+		vinfo.green.length = 8;
+		vinfo.blue.length = 8;
+	}
+	finfo.visual = FB_VISUAL_TRUECOLOR;
+	finfo.line_length = (w * depth + 15) & ~15;
+	bpp = depth;
+	fd = -1;
+	init_colors();
+}
+
+/* a framebuffer in a memfd, for testing without /dev/fb0 */
+static int sk_fake(int w, int h)
+{
+	int mfd;
+	sk_fbinfo(w, h, 4);
+	mfd = memfd_create("fvp", MFD_CLOEXEC);
+	if (mfd < 0 || ftruncate(mfd, fb_len()) < 0) {
+		perror("sk_fake()");
+		if (mfd >= 0)
+			close(mfd);
+		return 1;
+	}
+	fb = mmap(NULL, fb_len(), PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+	close(mfd);
+	return fb == MAP_FAILED;
+}
+
+/* create the shared memory described by "name[:WxH[:bpp[:slots]]]" */
+static int sk_init(char *spec, int w, int h)
+{
+	int depth = 4, slots = SK_SLOTS;
+	char *s = strchr(spec, ':');
+	int i, mfd;
+	snprintf(sk_name, sizeof(sk_name), "%s%.*s", spec[0] == '/' ? "" : "/",
+		s ? (int) (s - spec) : (int) strlen(spec), spec);
+	if (s)
+		sscanf(s + 1, "%dx%d:%d:%d", &w, &h, &depth, &slots);
+	if (depth != 2 && depth != 3)
+		depth = 4;
+	slots = MIN(MAX(slots, 2), 64);
+	sk_fbinfo(w, h, depth);
+	sk_len = sizeof(struct sk_head) +
+		(long) slots * (sizeof(struct sk_slot) + fb_len());
+	mfd = shm_open(sk_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (mfd < 0 || ftruncate(mfd, sk_len) < 0)
+		goto failed;
+	sk_head = mmap(NULL, sk_len, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+	close(mfd);
+	mfd = -1;
+	if (sk_head == MAP_FAILED)
+		goto failed;
+	sk_head->slots = slots;
+	sk_head->width = w;
+	sk_head->height = h;
+	sk_head->linelen = finfo.line_length;
+	sk_head->mode = fb_mode();
+	sk_head->slotoff = sizeof(struct sk_head);
+	sk_head->slotlen = sizeof(struct sk_slot) + fb_len();
+	for (i = 0; i < slots; i++)
+		sk_slot(i)->pts = -1;
+	memcpy(sk_head->magic, SK_MAGIC, sizeof(sk_head->magic));
+	sk_use(0);
+	return 0;
+failed:
+	perror("sk_init()");
+	if (mfd >= 0) {
+		close(mfd);
+		shm_unlink(sk_name);
+	}
+	sk_name[0] = '\0';
+	return 1;
+}
+
+/* publish the frame drawn in the current slot and move to the next */
+static void sk_publish(long pts)
+{
+	struct sk_slot *slot = sk_slot(sk_cur);
+	uint32_t seq = sk_head->seq + 1;
+	slot->pts = pts;
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&sk_head->last, sk_cur, __ATOMIC_RELEASE);
+	__atomic_store_n(&sk_head->seq, seq, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &sk_head->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	sk_use((sk_cur + 1) % sk_head->slots);
+}
+
+/* clear the frames of all slots */
+static void sk_clear(void)
+{
+	int i;
+	for (i = 0; i < (int) sk_head->slots; i++) {
+		__atomic_store_n(&sk_slot(i)->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		memset(sk_slot(i) + 1, 0, fb_len());
+	}
+}
+
+static void sk_free(void)
+{
+	munmap(sk_head, sk_len);
+	shm_unlink(sk_name);
+	sk_name[0] = '\0';
+}
@@ -0,0 +1,156 @@
+/* contact sheets of evenly spaced key frames */
+
+#define THUMB_FBM	((7 << 20) | (3 << 16) | 0x888)	/* RGB24 fb_mode() */
+
+static int th_cols, th_rows;		/* contact sheet grid */
+static int th_width = 320;		/* thumbnail width */
+static char *th_out = "%s.ppm";		/* output path; %s is the input name */
+
+static char **th_files;			/* input files */
+static int th_cnt;			/* number of input files */
+static int th_next;			/* the next file to process */
+static int th_failed;			/* number of failed files */
+static pthread_mutex_t th_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int th_ppm(char *path, char *img, int w, int h)
+{
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+		return 1;
+	fprintf(fp, "P6\n%d %d\n255\n", w, h);
+	fwrite(img, 3, w * h, fp);
+	return fclose(fp) != 0;
+}
+
+static int th_png(char *path, char *img, int w, int h)
+{
+	const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
+	AVCodecContext *cc = codec ? avcodec_alloc_context3(codec) : NULL;
+	AVFrame *frame = av_frame_alloc();
+	AVPacket *pkt = av_packet_alloc();
+	FILE *fp = NULL;
+	int ret = 1;
+	if (!cc || !frame || !pkt)
+		goto done;
+	cc->width = w;
+	cc->height = h;
+	cc->pix_fmt = AV_PIX_FMT_RGB24;
+	cc->time_base = (AVRational) {1, 1};
+	if (avcodec_open2(cc, codec, NULL) < 0)
+		goto done;
+	frame->data[0] = (uint8_t *) img;
+	frame->linesize[0] = w * 3;
+	frame->width = w;
+	frame->height = h;
+	frame->format = AV_PIX_FMT_RGB24;
+	if (avcodec_send_frame(cc, frame) < 0 || avcodec_receive_packet(cc, pkt) < 0)
+		goto done;
+	if (!(fp = fopen(path, "w")))
+		goto done;
+	fwrite(pkt->data, 1, pkt->size, fp);
+	ret = fclose(fp) != 0;
+done:
+	av_packet_free(&pkt);
+	av_frame_free(&frame);
+	avcodec_free_context(&cc);
+	return ret;
+}
+
+/* the output path for the given input file */
+static void th_path(char *dst, int len, char *src)
+{
+	char name[256];
+	char *base = strrchr(src, '/') ? strrchr(src, '/') + 1 : src;
+	char *s = strstr(th_out, "%s");
+	snprintf(name, sizeof(name), "%s", base);
+	if (strrchr(name, '.') && strrchr(name, '.') != name)
+		*strrchr(name, '.') = '\0';
+	if (s)
+		snprintf(dst, len, "%.*s%s%s", (int) (s - th_out), th_out, name, s + 2);
+	else
+		snprintf(dst, len, "%s", th_out);
+}
+
+static int th_file(char *src)
+{
+	struct ffs *ffs = ffs_alloc(src, FFS_VIDEO | FFS_KEYS);
+	int n = th_cols * th_rows;
+	int w, h, tw, th, sw;
+	long dur;
+	char path[1024];
+	char *img;
+	int i, r, ret;
+	if (!ffs)
+		return 1;
+	ffs_vinfo(ffs, &w, &h);
+	ffs_vconf(ffs, (float) th_width / w, THUMB_FBM);
+	tw = w * ((float) th_width / w);
+	th = h * ((float) th_width / w);
+	sw = tw * th_cols * 3;
+	if (!(img = calloc(th_rows * th, sw))) {
+		ffs_free(ffs);
+		return 1;
+	}
+	dur = ffs_duration(ffs);
+	for (i = 0; i < n; i++) {
+		char *dst = img + (i / th_cols) * th * sw + (i % th_cols) * tw * 3;
+		void *buf;
+		int pkts = 0;
+		ffs_seekkey(ffs, ffs, dur ? dur * (2 * i + 1) / (2 * n) : i * 10000l);
+		while ((ret = ffs_vdec(ffs, &buf)) == 0 && ++pkts < 1000)
+			;
+		if (ret <= 0) {
+			free(img);
+			ffs_free(ffs);
+			return 1;
+		}
+		for (r = 0; r < th; r++)
+			memcpy(dst + r * sw, (char *) buf + r * ret, tw * 3);
+	}
+	th_path(path, sizeof(path), src);
+	if (strlen(path) > 4 && !strcmp(path + strlen(path) - 4, ".png"))
+		ret = th_png(path, img, sw / 3, th_rows * th);
+	else
+		ret = th_ppm(path, img, sw / 3, th_rows * th);
+	free(img);
+	ffs_free(ffs);
+	return ret;
+}
+
+static void *th_worker(void *dat)
+{
+	while (1) {
+		int i;
+		pthread_mutex_lock(&th_lock);
+		i = th_next++;
+		pthread_mutex_unlock(&th_lock);
+		if (i >= th_cnt)
+			break;
+		if (th_file(th_files[i])) {
+			fprintf(stderr, "fvp: %s: failed\n", th_files[i]);
+			pthread_mutex_lock(&th_lock);
+			th_failed++;
+			pthread_mutex_unlock(&th_lock);
+		}
+	}
+	return NULL;
+}
+
+/* write the contact sheets of files using a thread per processor */
+static int th_main(char **files, int cnt)
+{
+	pthread_t thr[64];
+	int n = MIN(MIN(sysconf(_SC_NPROCESSORS_ONLN), 64), cnt);
+	int i;
+	th_files = files;
+	th_cnt = cnt;
+	for (i = 0; i < n; i++)
+		if (pthread_create(&thr[i], NULL, th_worker, NULL))
+			break;
+	n = i;
+	if (!n)
+		th_worker(NULL);
+	for (i = 0; i < n; i++)
+		pthread_join(thr[i], NULL);
+	return th_failed > 0;
+}